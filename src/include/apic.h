@@ -0,0 +1,78 @@
+#ifndef APIC_H
+#define APIC_H
+#include <system.h>
+#include <isr.h>
+
+// Where the local apic and the io apic are, unless the mp table says otherwise, both are mapped at the same virtual address
+#define LAPIC_DEFAULT_BASE  0xFEE00000
+#define IOAPIC_DEFAULT_BASE 0xFEC00000
+
+// Local apic registers(offsets from its base)
+#define LAPIC_ID            0x20
+#define LAPIC_TPR           0x80
+#define LAPIC_EOI           0xB0
+#define LAPIC_SVR           0xF0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CUR     0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+// Divide the bus clock by 16
+#define LAPIC_TIMER_DIV16   0x3
+
+// Interrupt command register
+#define ICR_INIT            0x500
+#define ICR_STARTUP         0x600
+#define ICR_LEVEL_ASSERT    0x4000
+#define ICR_LEVEL_TRIGGER   0x8000
+#define ICR_PENDING         0x1000
+
+// Vectors of the local apic interrupts, right after the 16 isa irqs
+#define LAPIC_TIMER_VECTOR  48
+#define RESCHED_VECTOR      49
+#define SPURIOUS_VECTOR     0xFF
+
+// Io apic registers, accessed through an index and a data register
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WINDOW       0x10
+#define IOAPIC_VER          0x01
+#define IOAPIC_REDTBL(pin)  (0x10 + 2 * (pin))
+
+// Redirection entry bits
+#define IOAPIC_ACTIVE_LOW   0x2000
+#define IOAPIC_LEVEL        0x8000
+#define IOAPIC_MASKED       0x10000
+
+extern int apic_enabled;
+
+void lapic_init(uint32_t base);
+
+void lapic_init_ap();
+
+uint32_t lapic_id();
+
+void lapic_eoi();
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t vector);
+
+void lapic_send_init(uint32_t apic_id);
+
+void lapic_send_startup(uint32_t apic_id, uint32_t page);
+
+void lapic_timer_init();
+
+void ioapic_init(uint32_t base);
+
+void ioapic_route(uint32_t pin, uint32_t vector, uint32_t flags, uint32_t apic_id);
+
+void apic_udelay(uint32_t us);
+
+#endif
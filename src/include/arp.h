@@ -3,10 +3,14 @@
 #include <system.h>
 #include <ethernet.h>
 #include <rtl8139.h>
+#include <wait_queue.h>
 
 #define ARP_REQUEST 1
 #define ARP_REPLY 2
 
+// How long ip_send_packet waits for a reply before asking again
+#define ARP_TIMEOUT_MS 500
+
 typedef struct arp_packet {
     uint16_t hardware_type;
     uint16_t protocol;
@@ -24,6 +28,9 @@ typedef struct arp_table_entry {
     uint64_t mac_addr;
 } arp_table_entry_t;
 
+// Tasks waiting for the arp table to change
+extern wait_queue_t arp_wait_queue;
+
 void arp_handle_packet(arp_packet_t * arp_packet, int len);
 
 void arp_send_packet(uint8_t * dst_hardware_addr, uint8_t * dst_protocol_addr);
@@ -3,6 +3,7 @@
 #include <system.h>
 #include <paging.h>
 #include <vfs.h>
+#include <wait_queue.h>
 
 extern page_directory_t * kpage_dir;
 
@@ -141,6 +142,8 @@ void software_reset(ata_dev_t * dev);
 
 void ata_handler(register_t * reg);
 
+void ata_secondary_handler(register_t * reg);
+
 void ata_open(vfs_node_t * node, uint32_t flags);
 
 void ata_close(vfs_node_t * node);
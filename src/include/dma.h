@@ -0,0 +1,24 @@
+#ifndef DMA_H
+#define DMA_H
+#include <system.h>
+#include <paging.h>
+
+/*
+ * A pool of physically contiguous memory for device dma, mapped once at DMA_POOL_START
+ * Buffers handed out don't move and can be kept by drivers for as long as they like(descriptor rings, bounce buffers)
+ * */
+#define DMA_POOL_START  0xD0000000
+// 2^6 frames, 256kb
+#define DMA_POOL_ORDER  6
+#define DMA_POOL_SIZE   ((1 << DMA_POOL_ORDER) * PAGE_SIZE)
+// Allocation unit, one cache line
+#define DMA_CHUNK_SIZE  64
+#define DMA_POOL_CHUNKS (DMA_POOL_SIZE / DMA_CHUNK_SIZE)
+
+void dma_init();
+
+void * dma_alloc(uint32_t size, uint32_t * phys);
+
+void dma_free(void * ptr, uint32_t size);
+
+#endif
@@ -161,6 +161,8 @@ uint32_t ext2_read(vfs_node_t * file, uint32_t offset, uint32_t size, char * buf
 
 uint32_t ext2_write(vfs_node_t * file, uint32_t offset, uint32_t size, char * buf);
 
+uint32_t ext2_readpage(vfs_node_t * file, uint32_t page_idx, char * buf);
+
 void ext2_open(vfs_node_t * file, uint32_t flags);
 
 void ext2_close();
@@ -0,0 +1,46 @@
+#ifndef FPU_H
+#define FPU_H
+#include <system.h>
+#include <isr.h>
+#include <process.h>
+
+// fxsave/fxrstor take a 512 byte, 16 byte aligned area
+#define FPU_STATE_SIZE  512
+#define FPU_STATE_ALIGN 16
+// mxcsr after reset: every simd exception masked, round to nearest
+#define MXCSR_DEFAULT   0x1F80
+// memcpy() only bothers with the fpu for copies at least this big
+#define FPU_MEMCPY_MIN  512
+
+// cr0 bits
+#define CR0_MP          0x2
+#define CR0_EM          0x4
+#define CR0_TS          0x8
+
+// The fxsave area of a task, which is allocated with some slack so it can be aligned
+#define fpu_area(p) ((void*)ALIGN((uint32_t)(p)->fpu_state, FPU_STATE_ALIGN))
+
+// Defined in sse.asm
+int sse_available();
+void sse_init();
+
+// Defined in fpu.c
+extern int fpu_ready;
+
+void fpu_init();
+
+void fpu_init_ap();
+
+void fpu_switch(pcb_t * prev, pcb_t * next);
+
+void fpu_fork(pcb_t * parent, pcb_t * child);
+
+void fpu_release(pcb_t * p);
+
+uint32_t kernel_fpu_begin();
+
+void kernel_fpu_end(uint32_t eflags);
+
+void fpu_nm_handler(register_t * reg);
+
+#endif
@@ -1,8 +1,15 @@
 #ifndef GDT_H
 #define GDT_H
 #include <system.h>
+// Most cpus brought up, see smp.c
+#define MAX_CPUS 8
+// Every cpu has a tss of its own, the bsp's is entry 5, entries 6 and 7 are bios32's 16bit segments, the other cpus' follow
+#define GDT_BSP_TSS     5
+#define GDT_AP_TSS      8
+#define GDT_TSS_ENTRY(cpu) ((cpu) ? GDT_AP_TSS + (cpu) - 1 : GDT_BSP_TSS)
+#define GDT_TSS_CPU(entry) ((entry) == GDT_BSP_TSS ? 0 : (entry) - GDT_AP_TSS + 1)
 // Number of global descriptors
-#define NUM_DESCRIPTORS 8
+#define NUM_DESCRIPTORS (GDT_AP_TSS + MAX_CPUS - 1)
 
 // Gdt related structures
 typedef struct gdt_entry
@@ -31,5 +38,6 @@ void gdt_init();
 void gdt_set_entry(int index, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
 
 extern gdt_entry_t gdt_entries[NUM_DESCRIPTORS];
+extern gdt_ptr_t gdt_ptr;
 
 #endif
@@ -20,6 +20,8 @@ typedef struct idt_ptr {
 // Extern asm functions
 extern void idt_flush(uint32_t ptr);
 
+extern idt_ptr_t idt_ptr;
+
 // Idt functions
 void idt_init();
 void idt_set_entry(int index, uint32_t base, uint16_t sel, uint8_t ring);
@@ -66,6 +66,9 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq16();
+extern void irq17();
+extern void irq_spurious();
 
 // Some IRQ constants
 #define IRQ_BASE                0x20
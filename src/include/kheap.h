@@ -35,6 +35,8 @@
 #define KHEAP_INITIAL_SIZE  48 * M
 #define KHEAP_MAX_ADDRESS   (void*)0xCFFFFFFF
 #define HEAP_MIN_SIZE       4 * M
+// free() gives the pages at the end of the heap back to the pmm once this many bytes can be released
+#define KHEAP_TRIM_THRESHOLD 1 * M
 
 
 #define PAGE_SIZE 4096
@@ -57,6 +59,37 @@ struct Block
     struct Block * next;
 };
 
+// Free blocks are kept in power-of-two size classes, one bin per bit of a 32-bit size
+#define KHEAP_NUM_BINS 32
+
+// Allocation trace, recorded by the kmalloc/kfree/krealloc wrappers and replayed by kheap_benchmark()
+#define TRACE_ALLOC   0
+#define TRACE_FREE    1
+#define TRACE_REALLOC 2
+#define KHEAP_BENCHMARK_OPS 4096
+
+// Allocation statistics are kept per call site of kmalloc/kcalloc/krealloc
+#define KHEAP_MAX_SITES 128
+// An allocated block's prev field holds KHEAP_SITE_TAG | index into the call site table
+#define KHEAP_SITE_TAG  0x5A110000
+// Index of allocations whose call site didn't fit in the table
+#define KHEAP_SITE_UNTRACKED 0xFFFF
+
+typedef struct kheap_site {
+    void * caller;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t live_bytes;
+    uint32_t peak_bytes;
+}kheap_site_t;
+
+typedef struct kheap_trace {
+    uint32_t op;
+    void * ptr;
+    void * old;
+    uint32_t size;
+}kheap_trace_t;
+
 unsigned int kmalloc_int(unsigned int sz, int align, unsigned int *phys);
 
 void * kmalloc_cont(unsigned int sz, int align, unsigned int *phys);
@@ -87,6 +120,8 @@ int isBetter(struct Block * node1, struct Block * node2);
 
 struct Block * bestfit(unsigned int size);
 
+uint32_t getBin(uint32_t size);
+
 struct Block * getPrevBlock(struct Block * n);
 
 struct Block * getNextBlock(struct Block * n);
@@ -109,4 +144,22 @@ void *kcalloc(unsigned int num, unsigned int size);
 
 void *realloc(void *ptr, unsigned int size);
 
+void kheap_trim();
+
+void kheap_set_trim_threshold(uint32_t bytes);
+
+uint32_t kheap_reclaimed_bytes();
+
+void kheap_free_stats(uint32_t * free_bytes, uint32_t * largest, uint32_t * num_free);
+
+uint32_t kheap_fragmentation(uint32_t free_bytes, uint32_t largest);
+
+void kheap_print_stats();
+
+void kheap_stats_periodic(uint32_t sec);
+
+void kheap_trace_start(uint32_t max_ops);
+
+void kheap_benchmark();
+
 #endif // KHEAP_H
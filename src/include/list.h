@@ -25,7 +25,7 @@ uint32_t list_size(list_t * list);
 
 listnode_t * list_insert_front(list_t * list, void * val);
 
-void list_insert_back(list_t * list, void * val);
+listnode_t * list_insert_back(list_t * list, void * val);
 
 void * list_remove_node(list_t * list, listnode_t * node);
 
@@ -0,0 +1,27 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+#include <system.h>
+#include <vfs.h>
+
+/*
+ * Page cache, file pages that have been read once, kept in frames so they can be mapped straight into any address space
+ * An entry owns one reference to its frame(see pmm_frame_share), every mapping of it holds another
+ * */
+#define PAGE_CACHE_BUCKETS 256
+
+typedef struct page_cache_entry {
+    // A file is identified by its filesystem and inode, vfs nodes come and go
+    void * device;
+    uint32_t inode_num;
+    uint32_t page_idx;
+    uint32_t frame;
+    struct page_cache_entry * next;
+}page_cache_entry_t;
+
+uint32_t page_cache_find(vfs_node_t * file, uint32_t page_idx);
+
+void page_cache_insert(vfs_node_t * file, uint32_t page_idx, uint32_t frame);
+
+void page_cache_invalidate(vfs_node_t * file);
+
+#endif
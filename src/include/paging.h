@@ -13,10 +13,33 @@
 #define PAGEDIR_INDEX(vaddr) (((uint32_t)vaddr) >> 22)
 #define PAGETBL_INDEX(vaddr) ((((uint32_t)vaddr) >>12) & 0x3ff)
 #define PAGEFRAME_INDEX(vaddr) (((uint32_t)vaddr) & 0xfff)
+// Offset into a 4mb page
+#define LARGEPAGE_OFFSET(vaddr) (((uint32_t)vaddr) & 0x3fffff)
+
+// A page directory entry with page_size set maps 4mb directly, no page table behind it
+#define LARGE_PAGE_SIZE (4 * 1024 * 1024)
+
+// Every page directory maps itself at its last entry, so the loaded address space's page tables are always at PAGE_TABLES
+// The entry before it is a window onto another address space, whose page tables then show up at FOREIGN_TABLES
+#define RECURSIVE_PDE   1023
+#define FOREIGN_PDE     1022
+#define PAGE_TABLES     ((page_table_t*)0xFFC00000)
+#define FOREIGN_TABLES  ((page_table_t*)0xFF800000)
+#define PAGE_DIRECTORY  ((page_directory_t*)0xFFFFF000)
+// The directory the window shows, it's the loaded directory's entry 1022 seen through the recursive mapping
+#define FOREIGN_DIRECTORY ((page_directory_t*)0xFFFFE000)
+
+// Frames of freed page tables are kept(already zeroed) for the next page table
+#define PAGE_TABLE_CACHE_SIZE    32
+#define PAGE_TABLE_CACHE_PREFILL 8
 
 // Paging register manipulation macro
 #define SET_PGBIT(cr0) (cr0 = cr0 | 0x80000000)
+#define SET_WPBIT(cr0) (cr0 = cr0 | 0x00010000)
+#define SET_PSEBIT(cr4) (cr4 = cr4 | 0x00000010)
 #define CLEAR_PSEBIT(cr4) (cr4 = cr4 & 0xffffffef)
+#define SET_PGEBIT(cr4) (cr4 = cr4 | 0x00000080)
+#define CLEAR_PGEBIT(cr4) (cr4 = cr4 & 0xffffff7f)
 
 // Err code interpretation
 #define ERR_PRESENT     0x1
@@ -25,6 +48,10 @@
 #define ERR_RESERVED    0x8
 #define ERR_INST        0x10
 
+// Bits of the "available" field in a page table entry
+// The page is shared copy-on-write, it's read-only until the first write fault makes a private copy
+#define PAGE_COW        0x1
+
 
 typedef struct page_dir_entry {
     unsigned int present    : 1;
@@ -47,7 +74,8 @@ typedef struct page_table_entry {
     unsigned int reserved   : 2;
     unsigned int accessed   : 1;
     unsigned int dirty      : 1;
-    unsigned int reserved2  : 2;
+    unsigned int pat        : 1;
+    unsigned int global     : 1;
     unsigned int available  : 3;
     unsigned int frame      : 20;
 }page_table_entry_t;
@@ -61,20 +89,28 @@ typedef struct page_table
 typedef struct page_directory
 {
     // The actual page directory entries(note that the frame number it stores is physical address)
+    // The tables themselves are reached through the recursive mapping, see table_of() in paging.c
+    // A directory is a bare frame, a page_directory_t * names it by its physical address, see dir_entries() in paging.c
     page_dir_entry_t tables[1024];
-    // We need a table that contains virtual address, so that we can actually get to the tables
-    page_table_t * ref_tables[1024];
 } page_directory_t;
 
+// Context switches timed by paging_benchmark()
+#define PAGING_BENCHMARK_SWITCHES 4096
+#define PAGING_BENCHMARK_BATCH    64
+// Kernel pages touched after every switch, the way a syscall or interrupt path would
+#define PAGING_BENCHMARK_PAGES    64
+
 // Defined in entry.asm
 extern page_directory_t * TEMP_PAGE_DIRECTORY;
 
 // Defined in pmm.c
 extern uint8_t * bitmap;
 extern uint32_t  bitmap_size;
+extern uint8_t * mem_start;
 
 // Defined in paging.c
 extern page_directory_t * kpage_dir;
+extern int large_pages;
 
 void * virtual2phys(page_directory_t * dir, void * virtual_addr);
 
@@ -82,23 +118,39 @@ void * dumb_kmalloc(uint32_t size, int align);
 
 void allocate_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va, int iden_map, int is_kernel, int is_writable);
 
-void allocate_page(page_directory_t * dir, uint32_t virtual_addr, uint32_t frame, int is_kernel, int is_writable);
+int allocate_page(page_directory_t * dir, uint32_t virtual_addr, uint32_t frame, int is_kernel, int is_writable);
+
+void allocate_large_page(page_directory_t * dir, uint32_t virtual_addr, uint32_t frame);
+
+void allocate_large_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va);
 
 void free_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va, int free);
 
 void free_page(page_directory_t * dir, uint32_t virtual_addr, int free);
 
-void paging_init();
+void free_page_table(page_directory_t * dir, uint32_t page_dir_idx);
+
+void free_mapped_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va);
 
-void switch_page_directory(page_directory_t * page_dir, uint32_t phys);
+page_directory_t * alloc_page_directory();
+
+void free_page_directory(page_directory_t * dir);
+
+void paging_zero_frame(uint32_t frame);
+
+void paging_init(int use_large_pages);
+
+void switch_page_directory(page_directory_t * page_dir);
 
 void enable_paging();
 
 void * ksbrk(int size);
 
-void copy_page_directory(page_directory_t * dst, page_directory_t * src);
+int copy_page_directory(page_directory_t * dst, page_directory_t * src);
 
-page_table_t * copy_page_table(page_directory_t * src_page_dir, page_directory_t * dst_page_dir, uint32_t page_dir_idx, page_table_t * src);
+int copy_page_table(page_directory_t * src_page_dir, page_directory_t * dst_page_dir, uint32_t page_dir_idx);
 
 void page_fault_handler(register_t * reg);
+
+void paging_benchmark();
 #endif
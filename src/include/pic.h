@@ -14,5 +14,6 @@
 
 void pic_init();
 void irq_ack(uint8_t irq);
+void pic_disable();
 
 #endif
@@ -8,10 +8,21 @@
 #define SETBIT(i) bitmap[i / BLOCKS_PER_BUCKET] = bitmap[i / BLOCKS_PER_BUCKET] | (1 << (i % BLOCKS_PER_BUCKET))
 #define CLEARBIT(i) bitmap[i / BLOCKS_PER_BUCKET] = bitmap[i / BLOCKS_PER_BUCKET] & (~(1 << (i % BLOCKS_PER_BUCKET)))
 #define ISSET(i) ((bitmap[i / BLOCKS_PER_BUCKET] >> (i % BLOCKS_PER_BUCKET)) & 0x1)
-#define GET_BUCKET32(i) (*((uint32_t*) &bitmap[i / 32]))
+#define GET_BUCKET32(i) (((uint32_t*)bitmap)[i / 32])
 
 #define BLOCK_ALIGN(addr) (((addr) & 0xFFFFF000) + 0x1000)
 
+// Buddy allocator: the leaves of the buddy tree are the 32-bit words of the bitmap, so a leaf covers an order 5 block(32 frames)
+#define BUDDY_LEAF_ORDER 5
+// Largest block the buddy allocator hands out in one go(2^10 frames = 4mb, the size of a whole page table)
+#define BUDDY_MAX_ORDER  10
+
+// Frames zeroed ahead of time for pmm_alloc_zeroed(), refilled by the idle task
+#define PMM_ZERO_POOL_SIZE  64
+
+// A frame can be shared by at most this many extra address spaces(frame reference counts are one byte)
+#define FRAME_MAX_SHARE 255
+
 // Defined in link.ld, indicate the end of kernel code/data
 extern uint32_t end;
 
@@ -21,7 +32,27 @@ uint32_t allocate_block();
 
 void free_block(uint32_t blk_num);
 
+uint32_t pmm_frame_share(uint32_t blk_num);
+
+uint32_t pmm_frame_refs(uint32_t blk_num);
+
 uint32_t first_free_block();
 
+void pmm_benchmark();
+
+uint32_t pmm_alloc_pages(uint32_t order);
+
+void pmm_free_pages(uint32_t blk_num, uint32_t order);
+
+uint32_t pmm_used_blocks();
+
+uint32_t pmm_free_blocks();
+
+void pmm_print_stats();
+
+uint32_t pmm_alloc_zeroed();
+
+uint32_t pmm_zero_pool_refill(uint32_t max);
+
 void simple_test();
 #endif
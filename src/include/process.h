@@ -12,11 +12,34 @@
 #include <string.h>
 #include <string.h>
 #include <elf_loader.h>
+#include <vma.h>
+#include <gdt.h>
+#include <tss.h>
 
 #define DEBUG_MULTITASK 0
 
 #define SCHED_TOLERANCE 5
 
+// Run queue levels, 0 is the highest priority, one bit of run_bitmap per level
+#define SCHED_PRIORITIES    8
+// A task at level p runs for (p + 1) * SCHED_BASE_SLICE ticks before it's preempted and moved down a level
+#define SCHED_BASE_SLICE    2
+// Every runnable task is moved back to level 0 this often(in ticks), so spinners can't starve each other forever
+#define SCHED_BOOST_TICKS   100
+
+// Every task has a kernel stack of its own, interrupts and syscalls from user mode run on it and switch_to() switches between them
+#define KSTACK_SIZE         8192
+
+// A cpu takes a task from the busiest cpu's run queues when it has this many fewer queued(or it has none and the other has any)
+#define SCHED_IMBALANCE     2
+
+// Task switches timed by sched_benchmark()
+#define SCHED_BENCHMARK_SWITCHES 100000
+
+// pcb flags
+// Runs in ring 0 on a stack of its own and borrows the loaded address space, see kthread.c
+#define PF_KTHREAD          0x1
+
 // All possible process state, copied from sched.h
 #define TASK_RUNNING            0
 #define TASK_INTERRUPTIBLE      1
@@ -29,6 +52,15 @@
 #define TASK_LOADING            128
 
 typedef uint32_t pid_t;
+
+// Where a process's heap starts if there's no executable to put it after
+#define USER_HEAP_START 0x40000000
+// Anonymous mmap areas are placed top down within [USER_MMAP_BOTTOM, USER_MMAP_TOP), below the user stack
+#define USER_MMAP_BOTTOM 0x80000000
+#define USER_MMAP_TOP    0xBF000000
+
+// Size of a process's file descriptor table
+#define PROCESS_MAX_FILES 16
 typedef struct context {
     uint32_t eax; // 0
     uint32_t ecx; // 4
@@ -45,26 +77,119 @@ typedef struct context {
 
 typedef struct pcb {
     char filename[512];
-    context_t regs;
     pid_t pid;
     listnode_t * self;
     void * stack;
     uint32_t state;
+    uint32_t flags;
+    // Kernel stack and where its stack pointer was left by switch_to()
+    void * kstack;
+    uint32_t kesp;
+    // Physical address of the page directory, 0 keeps whatever address space is loaded
+    uint32_t cr3;
+    // fxsave area, allocated the first time the task uses the fpu(see fpu.c)
+    void * fpu_state;
+    // Cpu whose fpu registers last held the task's state
+    struct cpu * fpu_cpu;
+    // Cpu whose run queues the task goes to, NULL until it's first enqueued
+    struct cpu * cpu;
+    // Big kernel lock depth, saved while the task is switched out
+    uint32_t lock_depth;
+    // Ticks left before the task is preempted, refilled when it's picked with nothing left
     uint32_t time_slice;
+    // Run queue level, tasks that use up their slice sink, tasks that give up the cpu early rise
+    uint32_t priority;
+    // The task's node in its run queue or in the blocked list, NULL while it's running
+    listnode_t * rq_node;
+    // Wakes the task up at the end of nanosleep()
+    ktimer_t sleep_timer;
     page_directory_t * page_dir;
+    // Number of user pages mapped(resident set size), kept by allocate_page() and free_page()
+    uint32_t resident_pages;
+    // Lazily mapped parts of the address space(segments of the executable, the heap and mmap areas)
+    vm_area_t * vmas;
+    // The heap is [brk_start, brk), see brk()
+    uint32_t brk_start;
+    uint32_t brk;
+    // Open files, indexed by file descriptor
+    vfs_node_t * files[PROCESS_MAX_FILES];
 }pcb_t;
 
+// The user mode registers of a task, pushed by the interrupt/syscall stubs at the top of its kernel stack
+#define task_frame(p) ((register_t*)((uint32_t)(p)->kstack + KSTACK_SIZE) - 1)
+
+/*
+ * Scheduler state of one cpu, every cpu schedules its own run queues and takes tasks from the others' when it runs out(see sched_balance)
+ * */
+typedef struct cpu {
+    uint32_t id;
+    uint32_t apic_id;
+    volatile int online;
+    // The task running on this cpu(NULL while it idles), and the one on the cpu, which is the idle task then
+    pcb_t * current;
+    pcb_t * running;
+    pcb_t * idle;
+    int idle_running;
+    // Set when the running task should give up the cpu, the timer handler then calls schedule()
+    int need_resched;
+    // Runnable tasks, one fifo per priority level, bit i of run_bitmap is set iff run_queue[i] isn't empty
+    list_t * run_queue[SCHED_PRIORITIES];
+    uint32_t run_bitmap;
+    uint32_t nr_queued;
+    uint32_t boost_jiffies;
+    // A task that exited, schedule() was still running on its kernel stack, so it's freed by the next schedule()
+    pcb_t * dead_task;
+    // Where switch_to puts the boot stack's esp when the cpu starts its first task, nothing ever switches back to it
+    uint32_t boot_kesp;
+    // Cpu time spent running tasks and idling
+    uint32_t busy_jiffies;
+    uint32_t idle_jiffies;
+    uint32_t busy_rest;
+    uint32_t idle_rest;
+    uint64_t account_stamp;
+    // The task whose state is in the fpu registers, and whether cr0.TS is set, see fpu.c
+    pcb_t * fpu_owner;
+    int fpu_ts;
+    // The directory this cpu last pointed the foreign window at and flushed its tlb for, and when, see map_foreign()
+    uint32_t window;
+    uint32_t window_generation;
+    // Times this cpu took the big kernel lock without giving it back, see lock_kernel()
+    uint32_t lock_depth;
+}cpu_t;
+
 extern list_t * process_list;
-extern pcb_t * current_process;
-extern register_t saved_context;
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t num_cpus;
+
+static inline cpu_t * this_cpu() {
+    return &cpus[smp_processor_id()];
+}
+
+// The task running on this cpu, NULL while it idles
+#define current_process (this_cpu()->current)
 
 
 
 pid_t allocate_pid();
 void process_init();
-void user_regs_switch(context_t * regs2);
-void kernel_regs_switch(context_t * regs2);
+// Defined in context_switch.asm
+void switch_to(uint32_t * prev_kesp, uint32_t next_kesp);
+void task_entry_user();
+void task_entry_kernel();
+void task_start();
+
+uint32_t task_stack_init(uint32_t * sp, void * ret);
 void schedule();
+void sched_enqueue(pcb_t * p);
+void sched_block(pcb_t * p);
+void sched_wakeup(pcb_t * p);
+void sched_preempt(register_t * reg);
+void sched_lapic_tick(register_t * reg);
+void sched_start_cpu(cpu_t * c);
+void schedule_tail();
+void sched_print_stats();
+void sched_stats_periodic(uint32_t sec);
 void create_process(char * filename);
 void create_process_from_routine(void * routine, char * name);
+void sched_benchmark();
 #endif
@@ -9,6 +9,11 @@
 #define RTL8139_DEVICE_ID 0x8139
 
 #define RX_BUF_SIZE 8192
+// The receive ring, plus room for the card to write a packet past its end(WRAP bit)
+#define RX_BUF_ALLOC (RX_BUF_SIZE + 16 + 1500)
+// One transmit buffer per TSAD register, the card can't send more than 1792 bytes at once
+#define TX_BUF_SIZE 1792
+#define TX_NUM_DESC 4
 
 #define CAPR 0x38
 #define RX_READ_POINTER_MASK (~3)
@@ -17,6 +22,10 @@
 #define TOK     (1<<2)
 #define TER     (1<<3)
 #define TX_TOK  (1<<15)
+// Set in a TSD register once the card has copied the descriptor's buffer to its fifo, the buffer can be reused then(it's set after reset too)
+#define TX_OWN  (1<<13)
+// How many times to read a busy descriptor's TSD before the packet is dropped
+#define TX_OWN_SPINS 100000
 
 enum RTL8139_registers {
   MAG0             = 0x00,       // Ethernet hardware address
@@ -70,6 +79,9 @@ typedef struct rtl8139_dev {
     int eeprom_exist;
     uint8_t mac_addr[6];
     char * rx_buffer;
+    uint32_t rx_phys;
+    char * tx_buffer[TX_NUM_DESC];
+    uint32_t tx_phys[TX_NUM_DESC];
     int tx_cur;
 }rtl8139_dev_t;
 
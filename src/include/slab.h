@@ -0,0 +1,54 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <system.h>
+
+// Every slab holds at least this many objects, and is at least a page big
+#define SLAB_MIN_OBJECTS 8
+#define KMEM_CACHE_NAME_LEN 32
+
+struct kmem_cache;
+
+/*
+ * A slab is one chunk of memory from kmalloc, cut into equally sized slots
+ * Each slot starts with a pointer back to its slab, so kmem_cache_free() can find the slab in O(1)
+ * */
+typedef struct kmem_slab {
+    struct kmem_slab * prev;
+    struct kmem_slab * next;
+    struct kmem_cache * cache;
+    // Free objects are chained through their first 4 bytes
+    void * free_objects;
+    uint32_t in_use;
+} kmem_slab_t;
+
+typedef struct kmem_cache {
+    char name[KMEM_CACHE_NAME_LEN];
+    uint32_t object_size;
+    uint32_t slot_size;
+    uint32_t objects_per_slab;
+    // Slabs with some free objects, no free objects, and only free objects
+    kmem_slab_t * partial;
+    kmem_slab_t * full;
+    kmem_slab_t * empty;
+    // Statistics
+    uint32_t num_slabs;
+    uint32_t active_objects;
+    uint32_t total_objects;
+    uint32_t allocs;
+    uint32_t frees;
+    struct kmem_cache * next;
+} kmem_cache_t;
+
+kmem_cache_t * kmem_cache_create(char * name, uint32_t size);
+
+void * kmem_cache_alloc(kmem_cache_t * cache);
+
+void * kmem_cache_zalloc(kmem_cache_t * cache);
+
+void kmem_cache_free(kmem_cache_t * cache, void * obj);
+
+void kmem_cache_print_stats(kmem_cache_t * cache);
+
+void kmem_cache_print_all();
+
+#endif
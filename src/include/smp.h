@@ -0,0 +1,118 @@
+#ifndef SMP_H
+#define SMP_H
+#include <system.h>
+#include <process.h>
+#include <spinlock.h>
+
+// The application processors start in real mode at this address(a page boundary below 1mb), out of bios32's way at 0x7c00
+#define TRAMPOLINE_BASE 0x7000
+
+// Where the mp floating pointer structure may be
+#define MP_EBDA_SEGMENT_PTR 0x40E
+#define MP_BASE_MEM_END     0x9FC00
+#define MP_BIOS_ROM_START   0xF0000
+#define MP_BIOS_ROM_END     0x100000
+
+// Entry types of the mp configuration table
+#define MP_PROCESSOR        0
+#define MP_BUS              1
+#define MP_IOAPIC           2
+#define MP_IOINTR           3
+#define MP_LINTR            4
+
+#define MP_CPU_ENABLED      0x1
+#define MP_CPU_BSP          0x2
+// The imcr is there and the pics are wired to the bsp through it(they have to be disconnected)
+#define MP_IMCR_PRESENT     0x80
+// An io interrupt entry of type 0 is a vectored interrupt(the others are nmi, smi and the pics' extint)
+#define MP_INTR_INT         0
+// Polarity and trigger mode of an io interrupt entry, "conforms" means whatever the bus does by default
+#define MP_POLARITY_MASK    0x3
+#define MP_POLARITY_LOW     0x3
+#define MP_POLARITY_HIGH    0x1
+#define MP_TRIGGER_MASK     0xC
+#define MP_TRIGGER_LEVEL    0xC
+#define MP_TRIGGER_EDGE     0x4
+
+// How long to wait for an application processor to show up
+#define SMP_INIT_DELAY_US     10000
+#define SMP_STARTUP_DELAY_US  200
+#define SMP_ONLINE_TIMEOUT_US 100000
+
+typedef struct mp_floating {
+    char signature[4];
+    uint32_t config;
+    uint8_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t type;
+    uint8_t features;
+    uint8_t reserved[3];
+} __attribute__((packed)) mp_floating_t;
+
+typedef struct mp_config {
+    char signature[4];
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+typedef struct mp_processor {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed)) mp_processor_t;
+
+typedef struct mp_bus {
+    uint8_t type;
+    uint8_t bus_id;
+    char bus_type[6];
+} __attribute__((packed)) mp_bus_t;
+
+typedef struct mp_ioapic {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t version;
+    uint8_t flags;
+    uint32_t addr;
+} __attribute__((packed)) mp_ioapic_t;
+
+typedef struct mp_iointr {
+    uint8_t type;
+    uint8_t intr_type;
+    uint16_t flags;
+    uint8_t src_bus;
+    uint8_t src_irq;
+    uint8_t dst_apic;
+    uint8_t dst_pin;
+} __attribute__((packed)) mp_iointr_t;
+
+// Defined in smp_trampoline.asm, the values are filled in before it's copied to TRAMPOLINE_BASE
+extern uint8_t smp_trampoline[];
+extern uint8_t smp_trampoline_end[];
+extern uint32_t trampoline_cr0;
+extern uint32_t trampoline_cr3;
+extern uint32_t trampoline_cr4;
+extern uint32_t trampoline_esp;
+extern uint32_t trampoline_entry;
+
+void smp_init();
+
+void lock_kernel();
+
+void unlock_kernel();
+
+#endif
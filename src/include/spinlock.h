@@ -1,8 +1,97 @@
-#ifndef SPINLOCK_T
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
 #include <system.h>
 
-void spinlock_lock(uint32_t * lock);
+// Collect per lock statistics(acquisitions, contention, wait time, hold time histogram), see lock_print_stats()
+#define LOCK_STATS 0
+// Hold times are counted in power of two buckets of tsc cycles, bucket i is [2^(i + LOCK_HIST_SHIFT), 2^(i + LOCK_HIST_SHIFT + 1)), the first and last are open ended
+#define LOCK_HIST_BUCKETS 16
+#define LOCK_HIST_SHIFT   6
 
-void spinlock_unlock(uint32_t * lock);
+// A writer holds a rwlock when this bit is set, the rest of the value counts readers
+#define RW_WRITER 0x80000000
+
+typedef struct lock_stats {
+    const char * name;
+    uint32_t acquisitions;
+    // Acquisitions that had to wait, and the cycles spent waiting
+    uint32_t contended;
+    uint64_t wait_cycles;
+    uint64_t hold_cycles;
+    uint32_t max_hold;
+    uint32_t hold_hist[LOCK_HIST_BUCKETS];
+    // Tsc when the current holder(writer) got the lock
+    uint64_t acquired_at;
+    int registered;
+    struct lock_stats * next;
+}lock_stats_t;
+
+/*
+ * Ticket lock, a locker takes the next ticket and waits until owner gets to it, so the lock is handed out in fifo order
+ * */
+typedef struct spinlock {
+    union {
+        volatile uint32_t value;
+        struct {
+            volatile uint16_t owner;
+            volatile uint16_t next;
+        };
+    };
+#if LOCK_STATS
+    lock_stats_t stats;
+#endif
+}spinlock_t;
+
+/*
+ * Reader-writer lock, any number of readers or one writer, a waiting writer keeps new readers out
+ * */
+typedef struct rwlock {
+    volatile uint32_t value;
+#if LOCK_STATS
+    lock_stats_t stats;
+#endif
+}rwlock_t;
+
+#if LOCK_STATS
+#define SPINLOCK_INIT(lock_name) {.value = 0, .stats = {.name = lock_name}}
+#define RWLOCK_INIT(lock_name) {.value = 0, .stats = {.name = lock_name}}
+#else
+#define SPINLOCK_INIT(lock_name) {.value = 0}
+#define RWLOCK_INIT(lock_name) {.value = 0}
+#endif
+
+void spinlock_init(spinlock_t * lock, const char * name);
+
+void spinlock_lock(spinlock_t * lock);
+
+int spinlock_trylock(spinlock_t * lock);
+
+void spinlock_unlock(spinlock_t * lock);
+
+uint32_t spinlock_lock_irqsave(spinlock_t * lock);
+
+void spinlock_unlock_irqrestore(spinlock_t * lock, uint32_t eflags);
+
+void rwlock_init(rwlock_t * lock, const char * name);
+
+void read_lock(rwlock_t * lock);
+
+void read_unlock(rwlock_t * lock);
+
+void write_lock(rwlock_t * lock);
+
+void write_unlock(rwlock_t * lock);
+
+uint32_t read_lock_irqsave(rwlock_t * lock);
+
+void read_unlock_irqrestore(rwlock_t * lock, uint32_t eflags);
+
+uint32_t write_lock_irqsave(rwlock_t * lock);
+
+void write_unlock_irqrestore(rwlock_t * lock, uint32_t eflags);
+
+void lock_print_stats();
+
+void lock_stats_periodic(uint32_t sec);
 
 #endif
@@ -6,7 +6,22 @@
 #include <process.h>
 #include <serial.h>
 
-#define NUM_SYSCALLS 5
+#define NUM_SYSCALLS 14
+
+// mmap protection and flags, only anonymous private mappings are supported
+#define PROT_NONE     0x0
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED    ((void*)-1)
+
+typedef struct timespec {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+}timespec_t;
 
 extern void * syscall_table[NUM_SYSCALLS];
 
@@ -16,5 +31,23 @@ void syscall_init();
 
 void _exit();
 
+pid_t fork();
+
+uint32_t brk(uint32_t addr);
+
+void * sbrk(int increment);
+
+void * mmap(void * addr, uint32_t length, uint32_t prot, uint32_t flags);
+
+int munmap(void * addr, uint32_t length);
+
+int open(char * path, uint32_t flags);
+
+int close(int fd);
+
+void * mmap_file(int fd, uint32_t offset, uint32_t length, uint32_t prot);
+
+int nanosleep(const timespec_t * req, timespec_t * rem);
+
 
 #endif
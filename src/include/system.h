@@ -71,6 +71,13 @@ void out_memb(uint32_t addr, uint8_t value);
 void out_mems(uint32_t addr, uint16_t value);
 void out_meml(uint32_t addr, uint32_t value);
 
+// Read the cpu time stamp counter, handy for timing things
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 // Defined in system.c
 void panic(const char *message, const char *file, uint32_t line);
 void print_reg(register_t * reg);
@@ -13,5 +13,10 @@ typedef struct tcb {
     context_t regs;
 }tcb_t;
 
-#endif
+typedef void (*kthread_fn) (void * arg);
+
+pcb_t * kthread_create(kthread_fn fn, void * arg);
 
+void kthread_exit();
+
+#endif
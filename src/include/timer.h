@@ -1,28 +1,57 @@
 #ifndef TIMER_H
 #define TIMER_H
-#include <isr.h>
-#include <list.h>
-#include <kheap.h>
-#include <process.h>
+#include <system.h>
 
 #define INPUT_CLOCK_FREQUENCY 1193180
 #define TIMER_COMMAND 0x43
 #define TIMER_DATA 0x40
-#define TIMER_ICW 0x36
+// Channel 0, LSB then MSB, mode 0(interrupt on terminal count, one shot), non-BCD
+#define TIMER_ONESHOT 0x30
+// Channel 0, latch the current count
+#define TIMER_LATCH 0x00
+
+// The pit is programmed for the next deadline, which is at least TIMER_MIN_DELTA(~17us) and at most 0xFFFF(~55ms) input clock ticks away
+#define TIMER_MIN_DELTA 20
+#define TIMER_MAX_DELTA 0xFFFF
+// Most timers that can be armed at once
+#define TIMER_HEAP_SIZE 256
+
+// Timer delays and periods are in pit input clock ticks(~838ns)
+#define TIMER_US(us)    ((((uint64_t)(us)) * 19549) >> 14)
+#define TIMER_SEC(sec)  (((uint64_t)(sec)) * INPUT_CLOCK_FREQUENCY)
+#define TIMER_JIFFY     (INPUT_CLOCK_FREQUENCY / hz)
+
+typedef void (*timer_callback) (void * data);
+
+// One shot(period 0) or periodic timer, called from the timer irq when it expires
+typedef struct ktimer {
+    uint64_t expires;
+    uint64_t period;
+    timer_callback func;
+    void * data;
+    // Position in the timer heap + 1, 0 if the timer isn't armed
+    uint32_t slot;
+} ktimer_t;
+
+// process.h needs ktimer_t
+#include <isr.h>
+#include <list.h>
+#include <kheap.h>
+#include <process.h>
+#include <wait_queue.h>
 
 extern uint32_t jiffies;
 extern uint16_t hz;
 typedef void (*wakeup_callback) ();
 
-typedef struct wakeup_info {
-    wakeup_callback func;
-    double sec;
-    uint32_t jiffies;
-} wakeup_info_t;
-
 void timer_init();
 void sleep(int sec);
 void set_frequency(uint16_t hz);
+uint64_t timer_now();
+void timer_setup(ktimer_t * t, timer_callback func, void * data);
+void timer_start(ktimer_t * t, uint64_t delay, uint64_t period);
+void timer_cancel(ktimer_t * t);
+int timer_pending(ktimer_t * t);
 void register_wakeup_call(wakeup_callback func, double sec);
 void timer_handler(register_t * reg);
 
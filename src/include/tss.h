@@ -48,9 +48,18 @@ typedef struct tss_entry {
     uint16_t iomap;
 }tss_entry_t;
 
-extern void tss_flush();
+extern void tss_flush(uint32_t selector);
 
-void tss_init(uint32_t idx, uint32_t kss, uint32_t kesp);
+/*
+ * Index of the cpu we're running on, taken from its task register(every cpu loads its own tss), 0 before the tss is loaded
+ * */
+static inline uint32_t smp_processor_id() {
+    uint16_t tr;
+    asm volatile("str %0" : "=r"(tr));
+    return tr ? GDT_TSS_CPU(tr >> 3) : 0;
+}
+
+void tss_init(uint32_t cpu, uint32_t kss, uint32_t kesp);
 
 void tss_set_stack(uint32_t kss, uint32_t kesp);
 
@@ -15,6 +15,8 @@
 #define PATH_UP  ".."
 #define PATH_DOT "."
 #define VFS_EXT2_MAGIC 0xeeee2222
+// Unit of vfs_readpage(), the size of a frame in the page cache
+#define VFS_PAGE_SIZE 4096
 
 #define O_RDONLY     0x0000
 #define O_WRONLY     0x0001
@@ -59,6 +61,7 @@ typedef int (*ioctl_callback) (struct vfs_node *, int request, void * argp);
 typedef int (*get_size_callback) (struct vfs_node *);
 typedef void (*chmod_callback) (struct vfs_node *, uint32_t mode);
 typedef char ** (*listdir_callback) (struct vfs_node *);
+typedef uint32_t (*readpage_callback) (struct vfs_node *, uint32_t, char *);
 
 typedef struct vfs_node {
     // Baisc information about a file(note: in linux, everything is file, so the vfs_node could be used to describe a file, directory or even a device!)
@@ -97,6 +100,7 @@ typedef struct vfs_node {
     get_file_size_callback get_file_size;
 
     listdir_callback listdir;
+    readpage_callback readpage;
 }vfs_node_t;
 
 struct dirent {
@@ -116,6 +120,8 @@ uint32_t vfs_read(vfs_node_t *node, uint32_t offset, uint32_t size, char *buffer
 
 uint32_t vfs_write(vfs_node_t *node, uint32_t offset, uint32_t size, char *buffer);
 
+uint32_t vfs_readpage(vfs_node_t *node, uint32_t page_idx, char *buffer);
+
 void vfs_open(struct vfs_node *node, uint32_t flags);
 
 void vfs_close(vfs_node_t *node);
@@ -0,0 +1,49 @@
+#ifndef VMA_H
+#define VMA_H
+#include <system.h>
+#include <vfs.h>
+
+// Protection flags of a virtual memory area
+#define VMA_READ  0x1
+#define VMA_WRITE 0x2
+#define VMA_EXEC  0x4
+// The area is the process's heap, grown and shrunk by brk/sbrk
+#define VMA_HEAP  0x8
+// Pages of the area are the file's page cache pages, mapped read-only and copied on write(file mmap)
+#define VMA_PAGECACHE 0x10
+
+/*
+ * A virtual memory area, a range of a process's address space that's mapped lazily
+ * Pages in [start, end) are not mapped until they're touched, the page fault handler then maps a frame and fills it:
+ * bytes in [data_start, data_end) come from file at file_offset, everything else is zero
+ * */
+typedef struct vm_area {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+    vfs_node_t * file;
+    uint32_t file_offset;
+    uint32_t data_start;
+    uint32_t data_end;
+    struct vm_area * next;
+}vm_area_t;
+
+vm_area_t * vma_add(vm_area_t ** list, uint32_t start, uint32_t end, uint32_t flags, vfs_node_t * file, uint32_t file_offset, uint32_t file_size);
+
+vm_area_t * vma_find(vm_area_t * list, uint32_t addr);
+
+vm_area_t * vma_find_flags(vm_area_t * list, uint32_t flags);
+
+int vma_overlaps(vm_area_t * list, uint32_t start, uint32_t end);
+
+uint32_t vma_find_gap(vm_area_t * list, uint32_t size, uint32_t bottom, uint32_t top);
+
+void vma_remove(vm_area_t ** list, uint32_t start, uint32_t end);
+
+void vma_fill_page(vm_area_t * list, uint32_t page_addr);
+
+vm_area_t * vma_copy_list(vm_area_t * list);
+
+void vma_destroy_list(vm_area_t * list);
+
+#endif
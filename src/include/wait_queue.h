@@ -0,0 +1,44 @@
+#ifndef WAIT_QUEUE_H
+#define WAIT_QUEUE_H
+#include <system.h>
+#include <list.h>
+
+// Defined in timer.c
+extern uint32_t jiffies;
+
+// Tasks sleeping until something happens(an irq, a packet, a timeout), an all zero wait queue is an empty one
+typedef struct wait_queue {
+    list_t waiters;
+}wait_queue_t;
+
+/*
+ * Sleep until condition is true, the condition is checked with interrupts off so a wake_up() from an irq handler can't be missed
+ * */
+#define wait_event(wq, condition) do { \
+    uint32_t __eflags; \
+    asm volatile("pushf; pop %0; cli" : "=r"(__eflags)); \
+    while(!(condition)) \
+        sleep_on(wq); \
+    asm volatile("push %0; popf" : : "r"(__eflags) : "memory", "cc"); \
+} while(0)
+
+/*
+ * Same as wait_event, but give up after ticks timer ticks
+ * */
+#define wait_event_timeout(wq, condition, ticks) do { \
+    uint32_t __eflags, __deadline = jiffies + (ticks); \
+    asm volatile("pushf; pop %0; cli" : "=r"(__eflags)); \
+    while(!(condition) && (int)(__deadline - jiffies) > 0) \
+        sleep_on_timeout(wq, __deadline - jiffies); \
+    asm volatile("push %0; popf" : : "r"(__eflags) : "memory", "cc"); \
+} while(0)
+
+void sleep_on(wait_queue_t * wq);
+
+uint32_t sleep_on_timeout(wait_queue_t * wq, uint32_t ticks);
+
+void sleep_for(uint64_t delay);
+
+void wake_up(wait_queue_t * wq);
+
+#endif
@@ -18,7 +18,7 @@ void bios32_init() {
     gdt_set_entry(7, 0, 0xffffffff, 0x92, 0x0f);
     // gdt ptr
     real_gdt_ptr.base = (uint32_t)gdt_entries;
-    real_gdt_ptr.limit = sizeof(gdt_entries) - 1;
+    real_gdt_ptr.limit = 8 * sizeof(gdt_entry_t) - 1;
     // idt ptr
     real_idt_ptr.base = 0;
     real_idt_ptr.limit = 0x3ff;
@@ -34,7 +34,8 @@ void bios32_service(uint8_t int_num, register16_t * in_reg, register16_t * out_r
 
     // Copy relevant data to [0x8c00, ...] (gdt_entries, gdt_ptr, idt_ptr and so on)
     // And calculate the new address of these data so bios32_helper can reference them
-    memcpy(&asm_gdt_entries, gdt_entries, sizeof(gdt_entries));
+    // Only the first 8 entries fit(the rest are other cpus' tss), real mode code doesn't need those
+    memcpy(&asm_gdt_entries, gdt_entries, 8 * sizeof(gdt_entry_t));
 
     real_gdt_ptr.base = (uint32_t)REBASE((&asm_gdt_entries));
     memcpy(&asm_gdt_ptr, &real_gdt_ptr, sizeof(real_gdt_ptr));
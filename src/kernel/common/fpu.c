@@ -0,0 +1,155 @@
+#include <fpu.h>
+#include <kheap.h>
+#include <serial.h>
+
+/*
+ * Lazy fpu/sse state switching
+ * The fpu registers hold the state of one task at most, fpu_owner. Switching to any other task sets cr0.TS, so the first fpu/sse instruction it runs
+ * raises #NM(exception 7), and only then the owner's state is saved with fxsave and the new task's loaded with fxrstor.
+ * A task that never touches the fpu never gets an fxsave area and costs nothing on a switch, neither does switching back to the owner.
+ * The kernel itself has to wrap simd code(fast_memcpy, for example) in kernel_fpu_begin()/kernel_fpu_end(), so it doesn't clobber the owner's registers
+ * Every cpu has its own fpu registers and owner(cpu_t's fpu_owner and fpu_ts). With more than one cpu a task can move to another cpu while its state is still in the registers here,
+ * so there a task that used the fpu is saved as it's switched out, and fpu_cpu tells which cpu's registers hold its newest state
+ * */
+
+int fpu_ready;
+
+static inline void fpu_set_ts(int ts) {
+    cpu_t * c = this_cpu();
+    if(c->fpu_ts == ts) return;
+    c->fpu_ts = ts;
+    if(!ts) {
+        asm volatile("clts");
+        return;
+    }
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS));
+}
+
+static inline void fpu_save(pcb_t * p) {
+    asm volatile("fxsave (%0)" : : "r"(fpu_area(p)) : "memory");
+}
+
+static inline void fpu_restore(pcb_t * p) {
+    asm volatile("fxrstor (%0)" : : "r"(fpu_area(p)) : "memory");
+}
+
+/*
+ * Called by schedule() before switching from prev to next, only the owner may use the fpu without trapping, and only on the cpu that has its state
+ * */
+void fpu_switch(pcb_t * prev, pcb_t * next) {
+    if(!fpu_ready) return;
+    cpu_t * c = this_cpu();
+    if(num_cpus > 1 && prev && c->fpu_owner == prev && !c->fpu_ts)
+        fpu_save(prev);
+    fpu_set_ts(next != c->fpu_owner || next->fpu_cpu != c);
+}
+
+/*
+ * #NM, the running task used the fpu while cr0.TS was set, give it its own state
+ * */
+void fpu_nm_handler(register_t * reg) {
+    cpu_t * c = this_cpu();
+    pcb_t * p = c->running;
+    fpu_set_ts(0);
+    if(c->fpu_owner == p && (!p || p->fpu_cpu == c)) return;
+    if(c->fpu_owner && c->fpu_owner->fpu_cpu == c)
+        fpu_save(c->fpu_owner);
+    if(!p) {
+        // Kernel init code, before the first task, there's nothing to keep
+        c->fpu_owner = NULL;
+        return;
+    }
+    if(p->fpu_state) {
+        fpu_restore(p);
+    }
+    else {
+        // First time this task uses the fpu, start from a clean state
+        p->fpu_state = kmalloc(FPU_STATE_SIZE + FPU_STATE_ALIGN);
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        asm volatile("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    }
+    c->fpu_owner = p;
+    p->fpu_cpu = c;
+}
+
+/*
+ * A forked child starts with a copy of the parent's fpu state
+ * */
+void fpu_fork(pcb_t * parent, pcb_t * child) {
+    if(!parent->fpu_state) return;
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    cpu_t * c = this_cpu();
+    if(c->fpu_owner == parent && parent->fpu_cpu == c) {
+        fpu_set_ts(0);
+        fpu_save(parent);
+    }
+    child->fpu_state = kmalloc(FPU_STATE_SIZE + FPU_STATE_ALIGN);
+    memcpy(fpu_area(child), fpu_area(parent), FPU_STATE_SIZE);
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+/*
+ * The task is going away, forget its fpu state
+ * */
+void fpu_release(pcb_t * p) {
+    for(uint32_t i = 0; i < num_cpus; i++) {
+        if(cpus[i].fpu_owner == p)
+            cpus[i].fpu_owner = NULL;
+    }
+    if(p->fpu_state)
+        kfree(p->fpu_state);
+    p->fpu_state = NULL;
+}
+
+/*
+ * Let the kernel use the fpu/sse registers, the owner's state is saved first, and it's reloaded on the owner's next fpu instruction
+ * Interrupts are off until kernel_fpu_end(), so nothing can switch tasks or use the fpu in between
+ * */
+uint32_t kernel_fpu_begin() {
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    fpu_set_ts(0);
+    cpu_t * c = this_cpu();
+    if(c->fpu_owner) {
+        if(c->fpu_owner->fpu_cpu == c)
+            fpu_save(c->fpu_owner);
+        c->fpu_owner = NULL;
+    }
+    return eflags;
+}
+
+void kernel_fpu_end(uint32_t eflags) {
+    // Whoever runs next(this task included) traps on its first fpu instruction and gets its state back
+    fpu_set_ts(1);
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+void fpu_init() {
+    if(!sse_available()) {
+        qemu_printf("fpu: no sse, fpu state isn't switched and simd copies are off\n");
+        return;
+    }
+    // Clears cr0.EM, sets cr0.MP and cr4.OSFXSR/OSXMMEXCPT
+    sse_init();
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    asm volatile("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    register_interrupt_handler(7, fpu_nm_handler);
+    this_cpu()->fpu_ts = 0;
+    fpu_set_ts(1);
+    fpu_ready = 1;
+}
+
+/*
+ * Same for an application processor, the bsp already found out whether there's sse
+ * */
+void fpu_init_ap() {
+    if(!fpu_ready) return;
+    sse_init();
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    asm volatile("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    this_cpu()->fpu_ts = 0;
+    fpu_set_ts(1);
+}
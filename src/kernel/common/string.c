@@ -2,8 +2,10 @@
 #include <system.h>
 #include <stdarg.h>
 #include <printf.h>
+#include <fpu.h>
 
-#define FAST_MEMCPY 0
+// Copy big buffers with sse, once the fpu state of tasks is switched(see fpu.c)
+#define FAST_MEMCPY 1
 void fast_memcpy(char * dst, char * src, uint32_t n);
 /*
  * Compare two buffer, return 1 if they're the same
@@ -21,16 +23,19 @@ int memcmp(uint8_t * data1, uint8_t * data2, int n) {
 void *memcpy(void *dst, void const *src, int n)
 {
 #if FAST_MEMCPY
-    fast_memcpy(dst, src, n);
-    return dst;
-#else
+    if(fpu_ready && n >= FPU_MEMCPY_MIN) {
+        uint32_t eflags = kernel_fpu_begin();
+        fast_memcpy(dst, (char*)src, n);
+        kernel_fpu_end(eflags);
+        return dst;
+    }
+#endif
     char * ret = dst;
     char * p = dst;
     const char * q = src;
     while (n--)
         *p++ = *q++;
     return ret;
-#endif
 
 }
 void *memset(void *dst,char val, int n)
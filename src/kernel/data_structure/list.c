@@ -1,9 +1,19 @@
 #include <list.h>
+#include <slab.h>
 
 /*
  * An implementation for generic, doubly linked list, may be handy in the future when we do vfs, process manmagement, etc..
  * */
 
+// List nodes are allocated and freed all the time, so they have their own cache
+kmem_cache_t * listnode_cache;
+
+static listnode_t * listnode_alloc() {
+    if(!listnode_cache)
+        listnode_cache = kmem_cache_create("listnode_t", sizeof(listnode_t));
+    return kmem_cache_zalloc(listnode_cache);
+}
+
 /*
  * Create a list and set head, tail to NULL, and size to 0
  * */
@@ -33,7 +43,7 @@ void * list_remove_node(list_t * list, listnode_t * node) {
         node->next->prev = node->prev;
         node->prev->next = node->next;
         list->size--;
-        kfree(node);
+        kmem_cache_free(listnode_cache, node);
     }
     return val;
 }
@@ -41,8 +51,9 @@ void * list_remove_node(list_t * list, listnode_t * node) {
  * Insert a value at the front of list
  * */
 listnode_t * list_insert_front(list_t * list, void * val) {
-	listnode_t * t = kcalloc(sizeof(listnode_t), 1);
-	list->head->prev = t;
+	listnode_t * t = listnode_alloc();
+    if(list->head)
+        list->head->prev = t;
     t->next = list->head;
 	t->val = val;
 
@@ -58,8 +69,8 @@ listnode_t * list_insert_front(list_t * list, void * val) {
 /*
  * Insert a value at the back of list
  * */
-void list_insert_back(list_t * list, void * val) {
-	listnode_t * t = kcalloc(sizeof(listnode_t), 1);
+listnode_t * list_insert_back(list_t * list, void * val) {
+	listnode_t * t = listnode_alloc();
 	t->prev = list->tail;
     if(list->tail)
         list->tail->next = t;
@@ -70,6 +81,7 @@ void list_insert_back(list_t * list, void * val) {
 
 	list->tail = t;
 	list->size++;
+	return t;
 }
 
 /*
@@ -82,7 +94,9 @@ void * list_remove_front(list_t * list) {
 	list->head = t->next;
 	if(list->head)
 		list->head->prev = NULL;
-	kfree(t);
+	else
+		list->tail = NULL;
+	kmem_cache_free(listnode_cache, t);
 	list->size--;
     return val;
 }
@@ -97,7 +111,9 @@ void * list_remove_back(list_t * list) {
 	list->tail = t->prev;
 	if(list->tail)
 		list->tail->next = NULL;
-	kfree(t);
+	else
+		list->head = NULL;
+	kmem_cache_free(listnode_cache, t);
 	list->size--;
     return val;
 }
@@ -190,12 +206,12 @@ void list_destroy(list_t * list) {
 	while(node != NULL) {
 		listnode_t * save = node;
 		node = node->next;
-		kfree(save);
+		kmem_cache_free(listnode_cache, save);
 	}
 	// Free the list
 	kfree(list);
 }
 
 void listnode_destroy(listnode_t * node) {
-	kfree(node);
+	kmem_cache_free(listnode_cache, node);
 }
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <pic.h>
 #include <isr.h>
+#include <apic.h>
 
 idt_entry_t idt_entries[NUM_IDT_ENTRIES];
 idt_ptr_t idt_ptr;
@@ -63,6 +64,9 @@ void idt_init() {
     idt_set_entry(45, (uint32_t)irq13, 0x08, 0x8E);
     idt_set_entry(46, (uint32_t)irq14, 0x08, 0x8E);
     idt_set_entry(47, (uint32_t)irq15, 0x08, 0x8E);
+    idt_set_entry(LAPIC_TIMER_VECTOR, (uint32_t)irq16, 0x08, 0x8E);
+    idt_set_entry(RESCHED_VECTOR, (uint32_t)irq17, 0x08, 0x8E);
+    idt_set_entry(SPURIOUS_VECTOR, (uint32_t)irq_spurious, 0x08, 0x8E);
     idt_set_entry(128, (uint32_t)exception128, 0x08, 0x8E);
 
     idt_flush((uint32_t)&(idt_ptr));
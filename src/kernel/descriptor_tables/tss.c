@@ -1,12 +1,14 @@
 #include <tss.h>
 
-tss_entry_t kernel_tss;
+tss_entry_t kernel_tss[MAX_CPUS];
 /*
  * We don't need tss to assist task switching, but it's required to have one tss for switching back to kernel mode(system call for example)
- *
+ * Every cpu needs its own, since each one runs a different task on a different kernel stack, cpu's tss is at GDT_TSS_ENTRY(cpu)
  * */
-void tss_init(uint32_t idx, uint32_t kss, uint32_t kesp) {
-    uint32_t base = (uint32_t)&kernel_tss;
+void tss_init(uint32_t cpu, uint32_t kss, uint32_t kesp) {
+    uint32_t idx = GDT_TSS_ENTRY(cpu);
+    tss_entry_t * tss = &kernel_tss[cpu];
+    uint32_t base = (uint32_t)tss;
     gdt_set_entry(idx, base, base + sizeof(tss_entry_t), 0xE9, 0);
     /* Kernel tss, access(E9 = 1 11 0 1 0 0 1)
         1   present
@@ -17,8 +19,8 @@ void tss_init(uint32_t idx, uint32_t kss, uint32_t kesp) {
         0   not readable
         1   access bit, always 0, cpu set this to 1 when accessing this sector(why 0 now?)
     */
-    memset(&kernel_tss, 0, sizeof(tss_entry_t));
-    kernel_tss.ss0 = kss;
+    memset(tss, 0, sizeof(tss_entry_t));
+    tss->ss0 = kss;
     // 上述表述的含义是：
 
     // 在启动操作系统时，我们通常将任务状态段（Task State Segment，TSS）的 esp 字段设置为0。然而，当切换到用户模式时，我们需要将其设置为真实的堆栈指针（ESP）。这是因为当用户模式应用程序调用内核函数（也称为系统调用）时，CPU 需要知道使用哪个堆栈指针来执行相应的操作。
@@ -30,20 +32,21 @@ void tss_init(uint32_t idx, uint32_t kss, uint32_t kesp) {
     // 这样做的目的是确保在系统调用期间，CPU 可以正确地处理用户模式和内核模式之间的堆栈切换，从而实现安全而有效的系统调用机制。
     // Note that we usually set tss's esp to 0 when booting our os, however, we need to set it to the real esp when we've switched to usermode because
     // the CPU needs to know what esp to use when usermode app is calling a kernel function(aka system call), that's why we have a function below called tss_set_stack
-    kernel_tss.esp0 = kesp;
-    kernel_tss.cs = 0x0b;
-    kernel_tss.ds = 0x13;
-    kernel_tss.es = 0x13;
-    kernel_tss.fs = 0x13;
-    kernel_tss.gs = 0x13;
-    kernel_tss.ss = 0x13;
-    tss_flush();
+    tss->esp0 = kesp;
+    tss->cs = 0x0b;
+    tss->ds = 0x13;
+    tss->es = 0x13;
+    tss->fs = 0x13;
+    tss->gs = 0x13;
+    tss->ss = 0x13;
+    tss_flush(idx << 3);
 }
 
 /*
  * This function is used to set the tss's esp, so that CPU knows what esp the kernel should be using
  * */
 void tss_set_stack(uint32_t kss, uint32_t kesp) {
-    kernel_tss.ss0 = kss;
-    kernel_tss.esp0 = kesp;
+    tss_entry_t * tss = &kernel_tss[smp_processor_id()];
+    tss->ss0 = kss;
+    tss->esp0 = kesp;
 }
@@ -1,5 +1,6 @@
 global tss_flush
+; void tss_flush(uint32_t selector)
 tss_flush:
-    mov ax, 0x28
+    mov eax, [esp + 4]
     ltr ax
     ret
@@ -0,0 +1,150 @@
+#include <apic.h>
+#include <pic.h>
+#include <paging.h>
+#include <timer.h>
+#include <process.h>
+#include <serial.h>
+
+/*
+ * Local apic and io apic
+ * Every cpu has a local apic, it delivers interrupts to its cpu, sends ipis to the other cpus and has a timer, which gives each cpu its own scheduler tick
+ * The io apic replaces the 8259 pics, its pins are routed to the same vectors(32 + irq), all to the bsp, see smp_init()
+ * Both are memory mapped, their registers are mapped at their physical address
+ * */
+
+int apic_enabled;
+volatile uint32_t * lapic;
+volatile uint32_t * ioapic;
+// Local apic timer ticks in one jiffy, measured by the bsp, the other cpus run at the same bus clock
+uint32_t lapic_ticks_per_jiffy;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    // Reading something back makes sure the write got there before we go on
+    (void)lapic[LAPIC_ID / 4];
+}
+
+static void apic_map(uint32_t base) {
+    allocate_page(kpage_dir, base, base >> 12, 1, 1);
+}
+
+static void apic_delay(uint64_t ticks) {
+    uint64_t end = timer_now() + ticks + 1;
+    while(timer_now() < end)
+        asm volatile("pause");
+}
+
+/*
+ * Busy wait, for the delays of the startup sequence
+ * */
+void apic_udelay(uint32_t us) {
+    apic_delay(TIMER_US(us));
+}
+
+static void lapic_enable() {
+    // Accept every priority, the pics' wires(lint0/lint1) are masked, the io apic takes over
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+/*
+ * Map and enable the bsp's local apic
+ * */
+void lapic_init(uint32_t base) {
+    apic_map(base);
+    lapic = (uint32_t*)base;
+    lapic_enable();
+}
+
+/*
+ * Enable the local apic of an application processor and start its timer
+ * */
+void lapic_init_ap() {
+    lapic_enable();
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, lapic_ticks_per_jiffy);
+}
+
+uint32_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while(lapic_read(LAPIC_ICR_LOW) & ICR_PENDING)
+        asm volatile("pause");
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t vector) {
+    lapic_send(apic_id, vector);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    lapic_send(apic_id, ICR_INIT | ICR_LEVEL_ASSERT | ICR_LEVEL_TRIGGER);
+}
+
+/*
+ * The cpu starts in real mode at page * 4096
+ * */
+void lapic_send_startup(uint32_t apic_id, uint32_t page) {
+    lapic_send(apic_id, ICR_STARTUP | page);
+}
+
+/*
+ * Find out how fast the bsp's local apic timer counts, against the pit, and make it tick every jiffy
+ * */
+void lapic_timer_init() {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    // Count for one jiffy of pit time
+    apic_delay(TIMER_JIFFY);
+    lapic_ticks_per_jiffy = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    qemu_printf("lapic: timer counts %u per jiffy\n", lapic_ticks_per_jiffy);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, lapic_ticks_per_jiffy);
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WINDOW / 4] = value;
+}
+
+/*
+ * Map the io apic and mask all its pins, ioapic_route() unmasks them
+ * */
+void ioapic_init(uint32_t base) {
+    apic_map(base);
+    ioapic = (uint32_t*)base;
+    uint32_t pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+    for(uint32_t i = 0; i < pins; i++) {
+        ioapic_write(IOAPIC_REDTBL(i), IOAPIC_MASKED);
+        ioapic_write(IOAPIC_REDTBL(i) + 1, 0);
+    }
+}
+
+/*
+ * Deliver pin to vector on the cpu with apic_id, flags are IOAPIC_ACTIVE_LOW/IOAPIC_LEVEL(edge triggered, active high otherwise)
+ * */
+void ioapic_route(uint32_t pin, uint32_t vector, uint32_t flags, uint32_t apic_id) {
+    ioapic_write(IOAPIC_REDTBL(pin) + 1, apic_id << 24);
+    ioapic_write(IOAPIC_REDTBL(pin), vector | flags);
+}
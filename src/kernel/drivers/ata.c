@@ -5,6 +5,8 @@
 #include <kheap.h>
 #include <string.h>
 #include <serial.h>
+#include <slab.h>
+#include <dma.h>
 
 pci_dev_t ata_device;
 
@@ -13,6 +15,42 @@ ata_dev_t primary_slave = {.slave = 1};
 ata_dev_t secondary_master = {.slave = 0};
 ata_dev_t secondary_slave = {.slave = 1};
 
+// Tasks waiting for a dma transfer to finish on the primary and the secondary channel, woken by the channel's irq handler
+// They're kept out of the packed ata_dev_t, the list inside has to stay aligned
+static wait_queue_t irq_wait[2];
+// A task sleeps in the middle of a transfer, so only one at a time may use a channel(its registers, and each device's prdt and dma buffer)
+static int channel_busy[2];
+static wait_queue_t channel_free[2];
+
+// Every ata_read_sector returns a sector sized buffer, the caller gives it back with kmem_cache_free
+kmem_cache_t * sector_cache;
+
+
+/*
+ * The channel the device is on, 0 for primary, 1 for secondary
+ * */
+static int channel_of(ata_dev_t * dev) {
+    return dev->data != 0x1F0;
+}
+
+/*
+ * Take the device's channel, sleeping while another task's transfer is using it
+ * */
+static void channel_lock(ata_dev_t * dev) {
+    int ch = channel_of(dev);
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    while(channel_busy[ch])
+        sleep_on(&channel_free[ch]);
+    channel_busy[ch] = 1;
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+static void channel_unlock(ata_dev_t * dev) {
+    int ch = channel_of(dev);
+    channel_busy[ch] = 0;
+    wake_up(&channel_free[ch]);
+}
 
 /*
  *  Equivalent to 400 ns delay
@@ -39,9 +77,26 @@ void ata_handler(register_t * reg) {
     inportb(primary_master.status);
     inportb(primary_master.BMR_STATUS);
     outportb(primary_master.BMR_COMMAND, BMR_COMMAND_DMA_STOP);
+    wake_up(&irq_wait[0]);
     //irq_ack(14);
 }
 
+void ata_secondary_handler(register_t * reg) {
+    inportb(secondary_master.status);
+    inportb(secondary_master.BMR_STATUS);
+    outportb(secondary_master.BMR_COMMAND, BMR_COMMAND_DMA_STOP);
+    wake_up(&irq_wait[1]);
+}
+
+/*
+ * The bus master raised its interrupt bit and the drive isn't busy anymore
+ * */
+static int ata_dma_done(ata_dev_t * dev) {
+    int status = inportb(dev->BMR_STATUS);
+    int dstatus = inportb(dev->status);
+    return (status & 0x04) && !(dstatus & 0x80);
+}
+
 
 void ata_open(vfs_node_t * node, uint32_t flags) {
         return;
@@ -85,6 +140,7 @@ uint32_t ata_read(vfs_node_t * node, uint32_t offset, uint32_t size, char * buf)
             read_size = end_offset - off + 1;
 
         memcpy(buf_curr, ret + off, read_size);
+        kmem_cache_free(sector_cache, ret);
         buf_curr = buf_curr + read_size;
         total = total + read_size;
         counter++;
@@ -120,6 +176,7 @@ uint32_t ata_write(vfs_node_t * node, uint32_t offset, uint32_t size, char * buf
         }
         memcpy(ret + off, buf_curr, write_size);
         ata_write_sector((ata_dev_t*)node->device, counter, ret);
+        kmem_cache_free(sector_cache, ret);
         buf_curr = buf_curr + write_size;
         total = total + write_size;
         counter++;
@@ -128,6 +185,7 @@ uint32_t ata_write(vfs_node_t * node, uint32_t offset, uint32_t size, char * buf
 }
 
 void ata_write_sector(ata_dev_t * dev, uint32_t lba, char * buf) {
+    channel_lock(dev);
     // First, copy the buffer over to dev->mem_buffer(Pointed to by prdt[0].buffer_phys)
     memcpy(dev->mem_buffer, buf, SECTOR_SIZE);
 
@@ -149,21 +207,14 @@ void ata_write_sector(ata_dev_t * dev, uint32_t lba, char * buf) {
     // Start DMA Writing
     outportb(dev->BMR_COMMAND, 0x1);
 
-    // Wait for dma write to complete
-    while (1) {
-        int status = inportb(dev->BMR_STATUS);
-        int dstatus = inportb(dev->status);
-        if (!(status & 0x04)) {
-            continue;
-        }
-        if (!(dstatus & 0x80)) {
-            break;
-        }
-    }
+    // Wait for the dma transfer to complete, the task sleeps until the irq handler wakes it up
+    wait_event(&irq_wait[channel_of(dev)], ata_dma_done(dev));
+    channel_unlock(dev);
 }
 
 char * ata_read_sector(ata_dev_t * dev, uint32_t lba) {
-    char * buf = kmalloc(SECTOR_SIZE);
+    char * buf = kmem_cache_alloc(sector_cache);
+    channel_lock(dev);
 
     // Reset bus master register's command register
     outportb(dev->BMR_COMMAND, 0);
@@ -183,19 +234,11 @@ char * ata_read_sector(ata_dev_t * dev, uint32_t lba) {
     // Start DMA reading
     outportb(dev->BMR_COMMAND, 0x8 | 0x1);
 
-    // Wait for dma write to complete
-    while (1) {
-        int status = inportb(dev->BMR_STATUS);
-        int dstatus = inportb(dev->status);
-        if (!(status & 0x04)) {
-            continue;
-        }
-        if (!(dstatus & 0x80)) {
-            break;
-        }
-    }
+    // Wait for the dma transfer to complete, the task sleeps until the irq handler wakes it up
+    wait_event(&irq_wait[channel_of(dev)], ata_dma_done(dev));
 
     memcpy(buf, dev->mem_buffer, SECTOR_SIZE);
+    channel_unlock(dev);
     return buf;
 
 }
@@ -220,14 +263,16 @@ vfs_node_t * create_ata_device(ata_dev_t * dev) {
 void ata_device_init(ata_dev_t * dev, int primary) {
 
     // Setup DMA
-    // Prdt must not cross 64kb boundary / contiguous in physical memory. So simply allocate a 4kb aligned page satisfy both conditions
-    dev->prdt = (void*)kmalloc_a(sizeof(prdt_t));
+    // Prdt must not cross 64kb boundary / contiguous in physical memory. The dma pool never lets a buffer of a page or less cross a page boundary, which satisfies both
+    uint32_t phys;
+    dev->prdt = dma_alloc(sizeof(prdt_t), &phys);
     memset(dev->prdt, 0, sizeof(prdt_t));
-    dev->prdt_phys = virtual2phys(kpage_dir, dev->prdt);
-    dev->mem_buffer = (void*)kmalloc_a(4096);
+    dev->prdt_phys = (uint8_t*)phys;
+    dev->mem_buffer = dma_alloc(4096, &phys);
     memset(dev->mem_buffer, 0, 4096);
+    dev->mem_buffer_phys = (uint8_t*)phys;
 
-    dev->prdt[0].buffer_phys = (uint32_t)virtual2phys(kpage_dir, dev->mem_buffer);
+    dev->prdt[0].buffer_phys = phys;
     dev->prdt[0].transfer_size = SECTOR_SIZE;
     dev->prdt[0].mark_end = MARK_END;
 
@@ -250,9 +295,11 @@ void ata_device_init(ata_dev_t * dev, int primary) {
     if(dev->bar4 & 0x1) {
         dev->bar4 = dev->bar4 & 0xfffffffc;
     }
-    dev->BMR_COMMAND = dev->bar4;
-    dev->BMR_STATUS = dev->bar4 + 2;
-    dev->BMR_prdt = dev->bar4 + 4;
+    // The secondary channel's bus master registers are the next 8 ports
+    uint32_t bmr = dev->bar4 + (primary ? 0 : 8);
+    dev->BMR_COMMAND = bmr;
+    dev->BMR_STATUS = bmr + 2;
+    dev->BMR_prdt = bmr + 4;
 
     // Set device's mountpoint(like /dev/hda)
     memset(dev->mountpoint, 0, 32);
@@ -321,9 +368,11 @@ void ata_init() {
     // 取pci controller设备
     // First, find pci device
     ata_device = pci_get_device(ATA_VENDOR_ID, ATA_DEVICE_ID, -1);
+    sector_cache = kmem_cache_create("ata_sector", SECTOR_SIZE);
 
     // Second, install irq handler
     register_interrupt_handler(32 + 14, ata_handler);
+    register_interrupt_handler(32 + 15, ata_secondary_handler);
 
     // Third, detect four ata devices
     ata_device_detect(&primary_master, 1);
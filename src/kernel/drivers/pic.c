@@ -1,5 +1,6 @@
 #include <system.h>
 #include <pic.h>
+#include <apic.h>
 
 /*
  * PIC is very complex, for a better understanding, visist
@@ -31,9 +32,20 @@ void pic_init() {
  * Tell PIC interrupt is handled
  * */
 void irq_ack(uint8_t irq) {
+    // Once the io apic delivers the irqs, they(and the local apic's own) are acknowledged to the local apic
+    if(apic_enabled) {
+        lapic_eoi();
+        return;
+    }
     if(irq >= 0x28)
         outportb(PIC2, PIC_EOI);
     outportb(PIC1, PIC_EOI);
 }
 
-
+/*
+ * Mask every irq of both pics, the io apic takes over
+ * */
+void pic_disable() {
+    outportb(PIC1_DATA, 0xFF);
+    outportb(PIC2_DATA, 0xFF);
+}
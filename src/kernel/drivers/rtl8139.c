@@ -3,6 +3,7 @@
 #include <serial.h>
 #include <string.h>
 #include <xxd.h>
+#include <dma.h>
 
 pci_dev_t pci_rtl8139_device;
 rtl8139_dev_t rtl8139_device;
@@ -71,15 +72,26 @@ void get_mac_addr(uint8_t * src_mac_addr) {
 }
 
 void rtl8139_send_packet(void * data, uint32_t len) {
-    // First, copy the data to a physically contiguous chunk of memory
-    void * transfer_data = kmalloc_a(len);
-    void * phys_addr = virtual2phys(kpage_dir, transfer_data);
-    memcpy(transfer_data, data, len);
+    if(len > TX_BUF_SIZE) {
+        qemu_printf("rtl8139_send_packet: packet too large(%u bytes)\n", len);
+        return;
+    }
+    // The buffers are reused round robin, wait for the card to be done with the packet this one still holds
+    uint32_t spins = 0;
+    while(!(inportl(rtl8139_device.io_base + TSD_array[rtl8139_device.tx_cur]) & TX_OWN)) {
+        if(++spins == TX_OWN_SPINS) {
+            qemu_printf("rtl8139_send_packet: transmit descriptor %u still busy, dropping packet\n", rtl8139_device.tx_cur);
+            return;
+        }
+        asm volatile("pause");
+    }
+    // First, copy the data to this descriptor's transmit buffer(physically contiguous, from the dma pool)
+    memcpy(rtl8139_device.tx_buffer[rtl8139_device.tx_cur], data, len);
 
     // Second, fill in physical address of data, and length
-    outportl(rtl8139_device.io_base + TSAD_array[rtl8139_device.tx_cur], (uint32_t)phys_addr);
+    outportl(rtl8139_device.io_base + TSAD_array[rtl8139_device.tx_cur], rtl8139_device.tx_phys[rtl8139_device.tx_cur]);
     outportl(rtl8139_device.io_base + TSD_array[rtl8139_device.tx_cur++], len);
-    if(rtl8139_device.tx_cur > 3)
+    if(rtl8139_device.tx_cur > TX_NUM_DESC - 1)
         rtl8139_device.tx_cur = 0;
 }
 
@@ -115,10 +127,14 @@ void rtl8139_init() {
         // Do nothibg here...
     }
 
-    // Allocate receive buffer
-    rtl8139_device.rx_buffer = kmalloc(8192 + 16 + 1500);
-    memset(rtl8139_device.rx_buffer, 0x0, 8192 + 16 + 1500);
-    outportl(rtl8139_device.io_base + 0x30, (uint32_t)virtual2phys(kpage_dir,rtl8139_device.rx_buffer));
+    // Allocate receive buffer, the card writes to it by physical address, so it has to be contiguous
+    rtl8139_device.rx_buffer = dma_alloc(RX_BUF_ALLOC, &rtl8139_device.rx_phys);
+    memset(rtl8139_device.rx_buffer, 0x0, RX_BUF_ALLOC);
+    outportl(rtl8139_device.io_base + 0x30, rtl8139_device.rx_phys);
+
+    // And the transmit buffers, reused for every packet
+    for(int i = 0; i < TX_NUM_DESC; i++)
+        rtl8139_device.tx_buffer[i] = dma_alloc(TX_BUF_SIZE, &rtl8139_device.tx_phys[i]);
 
     // Sets the TOK and ROK bits high
     outports(rtl8139_device.io_base + 0x3C, 0x0005);
@@ -5,54 +5,209 @@
 #include <draw.h>
 #include <rtc.h>
 #include <font.h>
+#include <slab.h>
+#include <smp.h>
 
 // Number of ticks since system booted
 uint32_t jiffies = 0;
 uint16_t hz = 0;
-// Functions that want to be woke up
-list_t * wakeup_list;
+// Pit input clock ticks since the timer was initialized, as of the last time the pit was programmed
+uint64_t clock_base;
+// What the pit was last programmed to count down from
+uint32_t pit_count;
+// Input clock ticks not yet turned into a jiffy
+uint32_t jiffy_rest;
+// Armed timers, a binary min heap ordered by expiry time
+ktimer_t * timer_heap[TIMER_HEAP_SIZE];
+uint32_t timer_count;
+// Timers of register_wakeup_call()
+kmem_cache_t * wakeup_cache;
+
+static void timer_reprogram();
+
 /*
  * Init timer by register irq
  * */
 void timer_init() {
-    // IRQ0 will fire 100 times per second
+    // jiffies count 100 times per second, the pit itself only fires when a timer is due(or every ~55ms if none is)
     set_frequency(100);
     register_interrupt_handler(32, timer_handler);
-    wakeup_list = list_create();
+    wakeup_cache = kmem_cache_create("ktimer_t", sizeof(ktimer_t));
+    timer_reprogram();
 }
 
+// Nobody wakes this one up, sleep() only waits for its timeout
+wait_queue_t sleep_queue;
+
 /*
- * Simulate sleep() in C, bad implementation, can use it for debug maybe ?
+ * Sleep for sec seconds, the cpu is halted between timer ticks instead of spinning on jiffies
  * */
 void sleep(int sec) {
-    uint32_t end = jiffies + sec * hz;
-    while(jiffies < end);
+    wait_event_timeout(&sleep_queue, 0, sec * hz);
 }
 
 /*
- * Originally, the frequency is 18 hz, u can change it to whatever you want
+ * Set how many jiffies there are in a second, the pit isn't running at a fixed frequency anymore, see timer_reprogram()
  * */
 void set_frequency(uint16_t h) {
     hz = h;
-    uint16_t divisor = INPUT_CLOCK_FREQUENCY / h;
-    // Init, Square Wave Mode, non-BCD, first transfer LSB then MSB
-    outportb(TIMER_COMMAND, TIMER_ICW);
-    outportb(TIMER_DATA, divisor & 0xFF);
-    outportb(TIMER_DATA, (divisor >> 8) & 0xFF);
+}
+
+/*
+ * Input clock ticks since the pit was last programmed
+ * */
+static uint32_t pit_elapsed() {
+    if(!pit_count) return 0;
+    outportb(TIMER_COMMAND, TIMER_LATCH);
+    uint32_t count = inportb(TIMER_DATA);
+    count |= inportb(TIMER_DATA) << 8;
+    // In mode 0 the counter keeps counting down(and wraps around) after it hits 0, so a count above the programmed one means we're past it
+    if(count <= pit_count)
+        return pit_count - count;
+    return pit_count + 0x10000 - count;
+}
+
+/*
+ * Current time in pit input clock ticks
+ * */
+uint64_t timer_now() {
+    // Reading the pit takes a latch command and two reads, another cpu mustn't get in between
+    lock_kernel();
+    uint64_t now = clock_base + pit_elapsed();
+    unlock_kernel();
+    return now;
+}
+
+/*
+ * Account for the time since the pit was last programmed, then program it for the earliest armed timer
+ * */
+static void timer_reprogram() {
+    uint32_t elapsed = pit_elapsed();
+    clock_base += elapsed;
+    jiffy_rest += elapsed;
+    while(jiffy_rest >= TIMER_JIFFY) {
+        jiffy_rest -= TIMER_JIFFY;
+        jiffies++;
+    }
+
+    uint64_t delta = TIMER_MAX_DELTA;
+    if(timer_count) {
+        uint64_t next = timer_heap[0]->expires;
+        delta = next > clock_base ? next - clock_base : 0;
+    }
+    if(delta < TIMER_MIN_DELTA)
+        delta = TIMER_MIN_DELTA;
+    if(delta > TIMER_MAX_DELTA)
+        delta = TIMER_MAX_DELTA;
+    pit_count = delta;
+    outportb(TIMER_COMMAND, TIMER_ONESHOT);
+    outportb(TIMER_DATA, pit_count & 0xFF);
+    outportb(TIMER_DATA, (pit_count >> 8) & 0xFF);
+}
+
+static void heap_set(uint32_t i, ktimer_t * t) {
+    timer_heap[i] = t;
+    t->slot = i + 1;
+}
+
+static void heap_sift_up(uint32_t i) {
+    ktimer_t * t = timer_heap[i];
+    while(i) {
+        uint32_t parent = (i - 1) / 2;
+        if(timer_heap[parent]->expires <= t->expires) break;
+        heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, t);
+}
+
+static void heap_sift_down(uint32_t i) {
+    ktimer_t * t = timer_heap[i];
+    while(1) {
+        uint32_t child = 2 * i + 1;
+        if(child >= timer_count) break;
+        if(child + 1 < timer_count && timer_heap[child + 1]->expires < timer_heap[child]->expires)
+            child++;
+        if(t->expires <= timer_heap[child]->expires) break;
+        heap_set(i, timer_heap[child]);
+        i = child;
+    }
+    heap_set(i, t);
+}
+
+static void heap_insert(ktimer_t * t) {
+    if(timer_count == TIMER_HEAP_SIZE)
+        PANIC("Too many timers armed");
+    heap_set(timer_count++, t);
+    heap_sift_up(timer_count - 1);
+}
+
+static void heap_remove(ktimer_t * t) {
+    uint32_t i = t->slot - 1;
+    t->slot = 0;
+    if(--timer_count == i) return;
+    // Move the last timer into the hole, it may have to go either way
+    heap_set(i, timer_heap[timer_count]);
+    heap_sift_up(i);
+    heap_sift_down(timer_heap[i]->slot - 1);
+}
+
+void timer_setup(ktimer_t * t, timer_callback func, void * data) {
+    memset(t, 0, sizeof(ktimer_t));
+    t->func = func;
+    t->data = data;
+}
+
+/*
+ * Arm a timer(rearm it if it's already armed) to expire delay input clock ticks from now, and then every period ticks if period isn't 0
+ * */
+void timer_start(ktimer_t * t, uint64_t delay, uint64_t period) {
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    lock_kernel();
+    if(t->slot)
+        heap_remove(t);
+    t->expires = timer_now() + delay;
+    t->period = period;
+    heap_insert(t);
+    // The pit is counting down to a later deadline, move it
+    if(timer_heap[0] == t)
+        timer_reprogram();
+    unlock_kernel();
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+/*
+ * Disarm a timer, the pit may still fire for it, but nothing happens then
+ * */
+void timer_cancel(ktimer_t * t) {
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    lock_kernel();
+    if(t->slot)
+        heap_remove(t);
+    unlock_kernel();
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+int timer_pending(ktimer_t * t) {
+    return t->slot != 0;
+}
 
+static void wakeup_call(void * data) {
+    ((wakeup_callback)data)();
 }
 
 /*
- * Call some function every x seconds
+ * Call some function every x seconds(every jiffy if sec is 0)
  * */
 void register_wakeup_call(wakeup_callback func, double sec) {
-    uint32_t jiffy = jiffies + sec * hz;
-    // Save the function sec, and jiffy to a list, when timer hits that func's jiffy it will call the func, and update next jiffies
-    wakeup_info_t * w = kmalloc(sizeof(wakeup_info_t));
-    w->func = func;
-    w->sec = sec;
-    w->jiffies = jiffy;
-    list_insert_front(wakeup_list, w);
+    uint64_t period = (uint32_t)(sec * INPUT_CLOCK_FREQUENCY);
+    if(period < TIMER_JIFFY)
+        period = TIMER_JIFFY;
+    ktimer_t * t = kmem_cache_alloc(wakeup_cache);
+    timer_setup(t, wakeup_call, func);
+    timer_start(t, period, period);
 }
 
 /*
@@ -64,12 +219,23 @@ void timer_handler(register_t * reg) {
 #if DEBUG_MULTITASK
     qemu_printf("Timer handler triggered...\n");
 #endif
-    jiffies++;
-    memcpy(&saved_context, reg, sizeof(register_t));
-    foreach(t, wakeup_list) {
-         wakeup_info_t * w = t->val;
-         w->func();
+    timer_reprogram();
+    while(timer_count && timer_heap[0]->expires <= clock_base) {
+        ktimer_t * t = timer_heap[0];
+        heap_remove(t);
+        if(t->period) {
+            // Keep the period steady, unless we're so late that it would fire again right away
+            t->expires += t->period;
+            if(t->expires <= clock_base)
+                t->expires = clock_base + t->period;
+            heap_insert(t);
+        }
+        t->func(t->data);
     }
+    // The callbacks may have armed new timers
+    timer_reprogram();
+    // Switch only after every expired timer had its turn
+    sched_preempt(reg);
     /*
     if(jiffies % 1080 == 0) {
         window_t * w = get_desktop_bar();
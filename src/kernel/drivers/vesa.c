@@ -110,5 +110,8 @@ void vesa_init() {
     //asm volatile("int $0x20");
     irq_ack(0x28);
     void * t = vesa_get_lfb();
-    allocate_region(kpage_dir, (uint32_t)t, (uint32_t)(t + 1024*768*4), 1,1,1);
+    if(large_pages)
+        allocate_large_region(kpage_dir, (uint32_t)t, (uint32_t)(t + 1024*768*4));
+    else
+        allocate_region(kpage_dir, (uint32_t)t, (uint32_t)(t + 1024*768*4), 1,1,1);
 }
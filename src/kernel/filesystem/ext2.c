@@ -2,13 +2,19 @@
 #include <system.h>
 #include <string.h>
 #include <serial.h>
+#include <slab.h>
+#include <page_cache.h>
+#include <math.h>
+
+// Every ext2 call reads an inode into a temporary inode_t, so they come from their own cache
+kmem_cache_t * inode_cache;
 
 uint32_t ext2_file_size(vfs_node_t * node) {
     ext2_fs_t * ext2fs = node->device;
-    inode_t * inode = kmalloc(sizeof(inode_t));
+    inode_t * inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, inode, node->inode_num);
     uint32_t ret = inode->size;
-    kfree(inode);
+    kmem_cache_free(inode_cache, inode);
     return ret;
 }
 /*
@@ -17,7 +23,7 @@ uint32_t ext2_file_size(vfs_node_t * node) {
 void ext2_mkdir(vfs_node_t * parent, char * name, uint16_t permission) {
     ext2_fs_t * ext2fs = parent->device;
     uint32_t inode_idx = alloc_inode(ext2fs);
-    inode_t * inode = kmalloc(sizeof(inode_t));
+    inode_t * inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, inode, inode_idx);
     inode->permission = EXT2_S_IFDIR;
     inode->permission |= 0xFFF & permission;
@@ -41,13 +47,15 @@ void ext2_mkdir(vfs_node_t * parent, char * name, uint16_t permission) {
     alloc_inode_block(ext2fs, inode, inode_idx, 0);
     write_inode_metadata(ext2fs, inode, inode_idx);
     ext2_create_entry(parent, name, inode_idx);
+    kmem_cache_free(inode_cache, inode);
 
     // May be add a "." and ".." to the entry ?
 
-    inode_t * p_inode = kmalloc(sizeof(inode_t));
+    inode_t * p_inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, p_inode, parent->inode_num);
     p_inode->hard_links++;
     write_inode_metadata(ext2fs, p_inode, parent->inode_num);
+    kmem_cache_free(inode_cache, p_inode);
     rewrite_bgds(ext2fs);
 }
 
@@ -57,7 +65,7 @@ void ext2_mkdir(vfs_node_t * parent, char * name, uint16_t permission) {
 void ext2_mkfile(vfs_node_t * parent, char * name, uint16_t permission) {
     ext2_fs_t * ext2fs = parent->device;
     uint32_t inode_idx = alloc_inode(ext2fs);
-    inode_t * inode = kmalloc(sizeof(inode_t));
+    inode_t * inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, inode, inode_idx);
     inode->permission = EXT2_S_IFREG;
     inode->permission |= 0xFFF & permission;
@@ -80,11 +88,13 @@ void ext2_mkfile(vfs_node_t * parent, char * name, uint16_t permission) {
     alloc_inode_block(ext2fs, inode, inode_idx, 0);
     write_inode_metadata(ext2fs, inode, inode_idx);
     ext2_create_entry(parent, name, inode_idx);
+    kmem_cache_free(inode_cache, inode);
 
-    inode_t * p_inode = kmalloc(sizeof(inode_t));
+    inode_t * p_inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, p_inode, parent->inode_num);
     p_inode->hard_links++;
     write_inode_metadata(ext2fs, p_inode, parent->inode_num);
+    kmem_cache_free(inode_cache, p_inode);
     rewrite_bgds(ext2fs);
 }
 
@@ -97,10 +107,11 @@ void ext2_unlink(vfs_node_t * parent, char * name) {
     ext2_fs_t * ext2fs = parent->device;
     ext2_remove_entry(parent, name);
 
-    inode_t * p_inode = kmalloc(sizeof(inode_t));
+    inode_t * p_inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, p_inode, parent->inode_num);
     p_inode->hard_links--;
     write_inode_metadata(ext2fs, p_inode, parent->inode_num);
+    kmem_cache_free(inode_cache, p_inode);
     rewrite_bgds(ext2fs);
 
 }
@@ -110,7 +121,7 @@ void ext2_unlink(vfs_node_t * parent, char * name) {
  * */
 char ** ext2_listdir(vfs_node_t * parent) {
     ext2_fs_t * ext2fs = parent->device;
-    inode_t * p_inode = kmalloc(sizeof(inode_t));
+    inode_t * p_inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, p_inode, parent->inode_num);
     uint32_t curr_offset = 0;
     uint32_t block_offset = 0;
@@ -144,6 +155,7 @@ char ** ext2_listdir(vfs_node_t * parent) {
         curr_offset += curr_dir->size;
     }
     ret[size] = NULL;
+    kmem_cache_free(inode_cache, p_inode);
     return ret;
 }
 /*
@@ -167,6 +179,7 @@ vfs_node_t * vfsnode_from_direntry(ext2_fs_t * ext2fs, direntry_t * dir, inode_t
         ret->flags   |= FS_FILE;
         ret->read     = ext2_read;
         ret->write    = ext2_write;
+        ret->readpage = ext2_readpage;
         ret->unlink = ext2_unlink;
         ret->get_file_size = ext2_file_size;
     }
@@ -205,7 +218,7 @@ vfs_node_t * vfsnode_from_direntry(ext2_fs_t * ext2fs, direntry_t * dir, inode_t
 
 vfs_node_t * ext2_finddir(vfs_node_t * parent, char *name) {
     ext2_fs_t * ext2fs = parent->device;
-    inode_t * p_inode = kmalloc(sizeof(inode_t));
+    inode_t * p_inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, p_inode, parent->inode_num);
     uint32_t expected_size;
     uint32_t real_size;
@@ -225,9 +238,12 @@ vfs_node_t * ext2_finddir(vfs_node_t * parent, char *name) {
         memcpy(temp, curr_dir->name, curr_dir->name_len);
         if(curr_dir->inode != 0 && !strcmp(temp, name)) {
              // Create a vfs node from the entry and return it
-             inode_t * inode = kmalloc(sizeof(inode_t));
+             inode_t * inode = kmem_cache_alloc(inode_cache);
              read_inode_metadata(ext2fs, inode, curr_dir->inode);
-             return vfsnode_from_direntry(ext2fs, curr_dir, inode);
+             vfs_node_t * ret = vfsnode_from_direntry(ext2fs, curr_dir, inode);
+             kmem_cache_free(inode_cache, inode);
+             kmem_cache_free(inode_cache, p_inode);
+             return ret;
         }
         if(((sizeof(direntry_t) + curr_dir->name_len) & 0x00000003) != 0)
             expected_size = ((sizeof(direntry_t) + curr_dir->name_len) & 0xfffffffc) + 0x4;
@@ -240,6 +256,7 @@ vfs_node_t * ext2_finddir(vfs_node_t * parent, char *name) {
         in_block_offset += curr_dir->size;
         curr_offset += curr_dir->size;
     }
+    kmem_cache_free(inode_cache, p_inode);
     return NULL;
 }
 
@@ -255,7 +272,7 @@ vfs_node_t * ext2_finddir(vfs_node_t * parent, char *name) {
  * */
 void ext2_create_entry(vfs_node_t * parent, char * entry_name, uint32_t entry_inode) {
     ext2_fs_t * ext2fs = parent->device;
-    inode_t * p_inode = kmalloc(sizeof(inode_t));
+    inode_t * p_inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, p_inode, parent->inode_num);
     uint32_t curr_offset = 0;
     uint32_t block_offset = 0;
@@ -276,6 +293,7 @@ void ext2_create_entry(vfs_node_t * parent, char * entry_name, uint32_t entry_in
             memcpy(check, curr_dir->name, entry_name_len);
             if(curr_dir->inode != 0 && !strcmp(entry_name, check)) {
                 qemu_printf("Entry by the same name %s already exist\n", check);
+                kmem_cache_free(inode_cache, p_inode);
                 return;
             }
         }
@@ -300,6 +318,7 @@ void ext2_create_entry(vfs_node_t * parent, char * entry_name, uint32_t entry_in
             curr_dir = (direntry_t*)(block_buf + in_block_offset);
             memset(curr_dir, 0, sizeof(direntry_t));
             write_inode_block(ext2fs, p_inode, block_offset, block_buf);
+            kmem_cache_free(inode_cache, p_inode);
             return;
         }
         uint32_t expected_size = ((sizeof(direntry_t) + curr_dir->name_len) & 0xfffffffc) + 0x4;
@@ -315,6 +334,7 @@ void ext2_create_entry(vfs_node_t * parent, char * entry_name, uint32_t entry_in
         in_block_offset += curr_dir->size;
         curr_offset += curr_dir->size;
     }
+    kmem_cache_free(inode_cache, p_inode);
 }
 
 /*
@@ -322,7 +342,7 @@ void ext2_create_entry(vfs_node_t * parent, char * entry_name, uint32_t entry_in
 */
 void ext2_remove_entry(vfs_node_t * parent, char * entry_name) {
     ext2_fs_t * ext2fs = parent->device;
-    inode_t * p_inode = kmalloc(sizeof(inode_t));
+    inode_t * p_inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, p_inode, parent->inode_num);
     uint32_t curr_offset = 0;
     uint32_t block_offset = 0;
@@ -343,25 +363,27 @@ void ext2_remove_entry(vfs_node_t * parent, char * entry_name) {
             if(curr_dir->inode != 0 && !strcmp(entry_name, check)) {
                 curr_dir->inode = 0;
                 write_inode_block(ext2fs, p_inode, block_offset, block_buf);
-                return;
+                break;
             }
         }
         uint32_t expected_size = ((sizeof(direntry_t) + curr_dir->name_len) & 0xfffffffc) + 0x4;
         uint32_t real_size = curr_dir->size;
         // Found the last entry
         if(real_size != expected_size)
-            return;
+            break;
         in_block_offset += curr_dir->size;
         curr_offset += curr_dir->size;
     }
+    kmem_cache_free(inode_cache, p_inode);
 }
 
 void ext2_chmod(vfs_node_t * file, uint32_t mode) {
     ext2_fs_t * ext2fs = file->device;
-    inode_t * inode = kmalloc(sizeof(inode_t));
+    inode_t * inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, inode, file->inode_num);
     inode->permission = (inode->permission & 0xFFFFF000) | mode;
     write_inode_metadata(ext2fs, inode, file->inode_num);
+    kmem_cache_free(inode_cache, inode);
 }
 
 /*
@@ -370,9 +392,10 @@ void ext2_chmod(vfs_node_t * file, uint32_t mode) {
 uint32_t ext2_read(vfs_node_t * file, uint32_t offset, uint32_t size, char * buf) {
     // Extract the ext2 filesystem object and inode from vfs node
     ext2_fs_t * ext2fs = file->device;
-    inode_t * inode = kmalloc(sizeof(inode_t));
+    inode_t * inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, inode, file->inode_num);
     read_inode_filedata(ext2fs, inode, offset, size, buf);
+    kmem_cache_free(inode_cache, inode);
     return size;
 }
 
@@ -382,12 +405,39 @@ uint32_t ext2_read(vfs_node_t * file, uint32_t offset, uint32_t size, char * buf
 uint32_t ext2_write(vfs_node_t * file, uint32_t offset, uint32_t size, char * buf) {
     // Extract the ext2 filesystem object and inode from vfs node
     ext2_fs_t * ext2fs = file->device;
-    inode_t * inode = kmalloc(sizeof(inode_t));
+    inode_t * inode = kmem_cache_alloc(inode_cache);
     read_inode_metadata(ext2fs, inode, file->inode_num);
     write_inode_filedata(ext2fs, inode, file->inode_num, offset, size, buf);
+    kmem_cache_free(inode_cache, inode);
+    // Pages mapped from now on have to see the new data
+    page_cache_invalidate(file);
     return size;
 }
 
+/*
+ * Read a page of the file straight into buf, disk block by disk block through the block mapping(no temporary buffers like read_inode_filedata)
+ * Holes and whatever is past the end of file read as zero
+ * */
+uint32_t ext2_readpage(vfs_node_t * file, uint32_t page_idx, char * buf) {
+    ext2_fs_t * ext2fs = file->device;
+    inode_t * inode = kmem_cache_alloc(inode_cache);
+    read_inode_metadata(ext2fs, inode, file->inode_num);
+    uint32_t offset = page_idx * VFS_PAGE_SIZE, n = 0;
+    if(offset < inode->size)
+        n = min(inode->size - offset, VFS_PAGE_SIZE);
+    uint32_t i = 0;
+    for(; i < n; i += ext2fs->block_size) {
+        uint32_t disk_block = get_disk_block_number(ext2fs, inode, (offset + i) / ext2fs->block_size);
+        if(disk_block)
+            read_disk_block(ext2fs, disk_block, buf + i);
+        else
+            memset(buf + i, 0, ext2fs->block_size);
+    }
+    memset(buf + n, 0, VFS_PAGE_SIZE - n);
+    kmem_cache_free(inode_cache, inode);
+    return n;
+}
+
 /*
  * Open ext2 file/dir
  * */
@@ -395,10 +445,11 @@ void ext2_open(vfs_node_t * file, uint32_t flags) {
     ext2_fs_t * ext2fs = file->device;
     // Overwrite the file on open
     if (flags & O_TRUNC) {
-        inode_t * inode = kmalloc(sizeof(inode_t));
+        inode_t * inode = kmem_cache_alloc(inode_cache);
         read_inode_metadata(ext2fs, inode, file->inode_num);
         inode->size = 0;
         write_inode_metadata(ext2fs, inode, file->inode_num);
+        kmem_cache_free(inode_cache, inode);
     }
 }
 
@@ -863,6 +914,8 @@ vfs_node_t * get_ext2_root(ext2_fs_t * ext2fs, inode_t * inode) {
  * */
 void ext2_init(char * device_path, char * mountpoint) {
     // First, we need to store some information about the ext2-formatted disk
+    if(!inode_cache)
+        inode_cache = kmem_cache_create("inode_t", sizeof(inode_t));
     ext2_fs_t * ext2fs = kcalloc(sizeof(ext2_fs_t), 1);
     ext2fs->disk_device= file_open(device_path, 0);
     ext2fs->sb = kmalloc(SUPERBLOCK_SIZE);
@@ -893,7 +946,8 @@ void ext2_init(char * device_path, char * mountpoint) {
     }
 
     // Then, mount it onto the vfs tree
-    inode_t * root_inode = kcalloc(sizeof(inode_t), 1);
+    inode_t * root_inode = kmem_cache_zalloc(inode_cache);
     read_inode_metadata(ext2fs, root_inode, ROOT_INODE_NUMBER);
     vfs_mount(mountpoint, get_ext2_root(ext2fs, root_inode));
+    kmem_cache_free(inode_cache, root_inode);
 }
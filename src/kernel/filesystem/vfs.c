@@ -117,6 +117,23 @@ void vfs_open(struct vfs_node *node, unsigned int flags) {
     node->open(node, flags);
 }
 
+/*
+ * Read the page_idx'th VFS_PAGE_SIZE bytes of a file, anything past the end of file reads as zero
+ * Filesystems that can read straight into the page do it with readpage, for the others it's a plain read
+ * */
+uint32_t vfs_readpage(vfs_node_t *node, uint32_t page_idx, char *buffer) {
+    if(!node) return 0;
+    if(node->readpage)
+        return node->readpage(node, page_idx, buffer);
+    uint32_t offset = page_idx * VFS_PAGE_SIZE, size = vfs_get_file_size(node), n = 0;
+    if(offset < size) {
+        n = (size - offset < VFS_PAGE_SIZE) ? size - offset : VFS_PAGE_SIZE;
+        vfs_read(node, offset, n, buffer);
+    }
+    memset(buffer + n, 0, VFS_PAGE_SIZE - n);
+    return n;
+}
+
 /*
  * Wrapper for physical filesystem close
  * */
@@ -2,6 +2,7 @@
 #include <isr.h>
 #include <serial.h>
 #include <vga.h>
+#include <smp.h>
 
 
 char *exception_messages[32] =
@@ -42,7 +43,16 @@ char *exception_messages[32] =
 
 
 void final_exception_handler(register_t reg) {
+    // Exceptions and syscalls(int 0x80) run under the big kernel lock, the same as irq handlers
+    lock_kernel();
     if(reg.int_no < 32) {
+        // Some exceptions can be fixed up(copy on write page faults, for example)
+        if(interrupt_handlers[reg.int_no] != NULL) {
+            isr_t handler = interrupt_handlers[reg.int_no];
+            handler(&reg);
+            unlock_kernel();
+            return;
+        }
         set_curr_color(LIGHT_RED);
         qemu_printf("EXCEPTION: %s (err code is %x)\n", exception_messages[reg.int_no], reg.err_code);
         print_reg(&reg);
@@ -53,5 +63,5 @@ void final_exception_handler(register_t reg) {
          isr_t handler = interrupt_handlers[reg.int_no];
          handler(&reg);
     }
-
+    unlock_kernel();
 }
@@ -3,6 +3,7 @@
 #include <pic.h>
 #include <printf.h>
 #include <serial.h>
+#include <smp.h>
 
 
 // For both exceptions and irq interrupt
@@ -18,11 +19,17 @@ void register_interrupt_handler(int num, isr_t handler) {
         interrupt_handlers[num] = handler;
 }
 
+/*
+ * The irq is acked before its handler runs, the handler may switch tasks(see sched_preempt) and the next task doesn't necessarily come back through here
+ * Handlers run under the big kernel lock, so only one cpu at a time is in the kernel
+ * */
 void final_irq_handler(register_t * reg) {
+    lock_kernel();
+    irq_ack(reg->int_no);
     if(interrupt_handlers[reg->int_no] != NULL) {
         isr_t handler = interrupt_handlers[reg->int_no];
         handler(reg);
     }
-    irq_ack(reg->int_no);
+    unlock_kernel();
 }
 
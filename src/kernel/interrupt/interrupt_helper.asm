@@ -25,6 +25,14 @@ IRQ 12, 44
 IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
+; Interrupts of the local apics(its timer and the reschedule ipi), see apic.h
+IRQ 16, 48
+IRQ 17, 49
+
+; A spurious interrupt from the local apic isn't acknowledged, there's nothing to do
+global irq_spurious
+irq_spurious:
+    iret
 
 extern final_irq_handler
 
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <ext2.h>
 #include <process.h>
+#include <thread.h>
 #include <usermode.h>
 #include <syscall.h>
 #include <elf_loader.h>
@@ -34,6 +35,9 @@
 #include <serial.h>
 #include <blend.h>
 #include <spinlock.h>
+#include <dma.h>
+#include <fpu.h>
+#include <smp.h>
 
 
 extern uint8_t * bitmap;
@@ -43,35 +47,48 @@ extern datetime_t current_datetime;
 #define MSIZE 48 * M
 #define GUI_MODE 0
 #define NETWORK_MODE 0
-
-void user_process2() {
-    uint32_t lock = 0;
+#define PMM_BENCHMARK 0
+#define KHEAP_BENCHMARK 0
+#define PAGING_BENCHMARK 0
+// Time task switches instead of starting the demo processes, see sched_benchmark()
+#define SCHED_BENCHMARK 0
+// Dump kernel heap statistics to the serial port every KHEAP_STATS seconds, 0 turns it off
+#define KHEAP_STATS 0
+// Print the cpu utilization(busy vs idle time) and every process's resident memory to the serial port every SCHED_STATS seconds, 0 turns it off
+#define SCHED_STATS 0
+// Dump lock statistics to the serial port every LOCK_STATS_DUMP seconds(they're only collected with LOCK_STATS in spinlock.h), 0 turns it off
+#define LOCK_STATS_DUMP 0
+// Map the kernel, the initial heap and the framebuffer with 4mb pages, 0 maps everything with 4kb pages
+#define LARGE_PAGES 1
+// Bring up the other cpus(and switch from the pics to the apics), 0 runs on the bsp alone
+#define SMP 1
+
+// Keeps the demo tasks' lines from interleaving
+spinlock_t print_lock = SPINLOCK_INIT("print");
+
+void user_process2(void * arg) {
     while(1) {
         for(int i = 0; i < 10000; i++) {
             for(int j= 0; j < 2000; j++) {
 
             }
         }
-        spinlock_lock(&lock);
+        spinlock_lock(&print_lock);
         qemu_printf("hi there2\n");
-        spinlock_unlock(&lock);
+        spinlock_unlock(&print_lock);
     }
 }
 
 void user_process() {
-    uint32_t lock = 0;
-    for(int i = 0; i < 20; i++) {
-        create_process_from_routine(user_process2, "user process2");
-    }
     while(1) {
         for(int i = 0; i < 10000; i++) {
             for(int j= 0; j < 2000; j++) {
 
             }
         }
-        spinlock_lock(&lock);
+        spinlock_lock(&print_lock);
         qemu_printf("hi there\n");
-        spinlock_unlock(&lock);
+        spinlock_unlock(&print_lock);
     }
 }
 
@@ -81,17 +98,32 @@ int kmain(multiboot_info_t * mb_info) {
 
     process_init();
     syscall_init();
+#if SMP
+    // Before the first task, so nothing is scheduled while the interrupts move to the apics
+    smp_init();
+#endif
 
-    // Set TSS stack so that when process return from usermode to kernel mode, the kernel have a ready-to-use stack
-    uint32_t esp;
-    asm volatile("mov %%esp, %0" : "=r"(esp));
-    tss_set_stack(0x10, esp);
-
+#if SCHED_BENCHMARK
+    sched_benchmark();
+#else
     // Start the first process
     create_process_from_routine(user_process, "user process");
+    // They don't need an address space of their own, kthread_create runs in ring 0 so they're started here, not from the user process
+    for(int i = 0; i < 20; i++) {
+        kthread_create(user_process2, NULL);
+    }
+#endif
+#if SCHED_STATS
+    sched_stats_periodic(SCHED_STATS);
+#endif
+#if LOCK_STATS_DUMP
+    lock_stats_periodic(LOCK_STATS_DUMP);
+#endif
 
     qemu_printf("\nDone!\n");
-    for(;;);
+    // Switch to the first process, the idle task runs whenever nothing else can, we never come back here
+    asm volatile("cli");
+    schedule();
     return 0;
 }
 
@@ -124,7 +156,7 @@ void completed_init() {
     // TI: Specifies which descriptor table to use. If clear (0) then the GDT is used, if set (1) then the current LDT is used.
     // RPL: The requested Privilege Level of the selector, determines if the selector is valid during permission checks and may set execution or memory access privilege.
     // , the low three bits are zero
-    tss_init(5, 0x10, 0);
+    tss_init(0, 0x10, 0);
 
     qemu_printf("Initializing physical memory manager...\n");
     // 
@@ -132,7 +164,7 @@ void completed_init() {
     pmm_init(1096 * M);
 
     qemu_printf("Initializing paging...\n");
-    paging_init();
+    paging_init(LARGE_PAGES);
 
     // 在提供的代码库中，kheap_init函数的目的是初始化操作系统的堆内存管理器。它接受三个参数：start、end和max。
 
@@ -148,10 +180,30 @@ void completed_init() {
     qemu_printf("Initializing kernel heap...\n");
     kheap_init(KHEAP_START, KHEAP_START + KHEAP_INITIAL_SIZE, KHEAP_MAX_ADDRESS);
 
+    qemu_printf("Initializing dma pool...\n");
+    dma_init();
+
+#if PMM_BENCHMARK
+    pmm_benchmark();
+#endif
+#if PAGING_BENCHMARK
+    paging_benchmark();
+#endif
+#if KHEAP_BENCHMARK
+    // Record the allocations the rest of the init code does, they're replayed by kheap_benchmark()
+    kheap_trace_start(KHEAP_BENCHMARK_OPS);
+#endif
+
     // 时钟唤醒
     qemu_printf("Initializing timer...\n");
     timer_init();
 
+    qemu_printf("Initializing fpu/sse...\n");
+    fpu_init();
+#if KHEAP_STATS
+    kheap_stats_periodic(KHEAP_STATS);
+#endif
+
     // pci初始化，主要设置pci config space 各域大小
     qemu_printf("Initializing pci...\n");
     pci_init();
@@ -172,6 +224,10 @@ void completed_init() {
     rtc_init();
     qemu_printf("Current date and time: %s\n", datetime_to_str(&current_datetime));
 
+#if KHEAP_BENCHMARK
+    kheap_benchmark();
+#endif
+
 #if GUI_MODE
     vesa_init();
     compositor_init();
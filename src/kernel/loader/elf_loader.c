@@ -1,5 +1,7 @@
 #include <elf_loader.h>
 #include <serial.h>
+#include <syscall.h>
+#include <smp.h>
 
 int valid_elf(elf_header_t * elf_head) {
     if(elf_head->e_ident[EI_MAG0] != ELFMAG0)
@@ -23,55 +25,66 @@ int valid_elf(elf_header_t * elf_head) {
         return 0;
     return 1;
 }
+/*
+ * Load an executable lazily
+ * Only the elf header and program headers are read here, every PT_LOAD segment is recorded as a vm area of the process and left unmapped
+ * The page fault handler reads each page from the file the first time it's touched, so startup time doesn't depend on the size of the executable
+ * It's the first thing a new process runs(see create_process), outside any interrupt handler, so it takes the big kernel lock itself
+ * */
 void do_elf_load() {
-    uint32_t seg_begin, seg_end;
+    uint32_t seg_begin, seg_end, brk_start = 0;
+    lock_kernel();
     char * filename = current_process->filename;
     current_process->state = TASK_LOADING;
     vfs_node_t * f = file_open(filename, 0);
     if(!f) {
         PANIC("elf load: file does not exists\n");
     }
-    uint32_t size = vfs_get_file_size(f);
-    // First, kmalloc a memory chunk for the file
-    void * file = kmalloc(size);
-    // Second, read from disk
-    vfs_read(f, 0, size, file);
-    // Start parsing and loading
-    elf_header_t * head = file;
-    elf_program_header_t * prgm_head = (void*)head + head->e_phoff;
+    // First, read the elf header
+    elf_header_t * head = kmalloc(sizeof(elf_header_t));
+    vfs_read(f, 0, sizeof(elf_header_t), (char*)head);
 
     // Check elf validity
     if(!valid_elf(head)) {
         qemu_printf("Invalid/Unsupported elf executable %s\n", filename);
-        return;
+        kfree(head);
+        _exit();
     }
 
-    // Go through all loadable segments and calculate the size needed by the executable image
+    // Then the program headers
+    uint32_t phdrs_size = head->e_phnum * sizeof(elf_program_header_t);
+    elf_program_header_t * phdrs = kmalloc(phdrs_size);
+    vfs_read(f, head->e_phoff, phdrs_size, (char*)phdrs);
+    elf_program_header_t * prgm_head = phdrs;
+
+    // Go through all loadable segments and record them, nothing is read or mapped yet
     for(uint32_t i = 0; i < head->e_phnum; i++) {
         if(prgm_head->p_type == PT_LOAD) {
             seg_begin = prgm_head->p_vaddr;
             seg_end= seg_begin + prgm_head->p_memsz;
-            // allocate this region
-            allocate_region(current_process->page_dir, seg_begin, seg_end, 0, 0, 1);
-            // Load segment data
-            memcpy((void*)seg_begin, file + prgm_head->p_offset, prgm_head->p_filesz);
-            // Fill zeros in the region [filesz, memsz]
-            memset((void*)(seg_begin + prgm_head->p_filesz), 0, prgm_head->p_memsz - prgm_head->p_filesz);
+            // [filesz, memsz] of the segment is zero filled by the page fault handler
+            uint32_t flags = VMA_READ;
+            if(prgm_head->p_flags & PF_W) flags |= VMA_WRITE;
+            if(prgm_head->p_flags & PF_X) flags |= VMA_EXEC;
+            vma_add(&current_process->vmas, seg_begin, seg_end, flags, f, prgm_head->p_offset, prgm_head->p_filesz);
+            // The heap starts on the page after the last segment
+            if(ALIGN(seg_end, PAGE_SIZE) > brk_start)
+                brk_start = ALIGN(seg_end, PAGE_SIZE);
             // If this is the code segment
             if(prgm_head->p_flags == PF_X + PF_R + PF_W || prgm_head->p_flags == PF_X + PF_R) {
-                 current_process->regs.eip = head->e_entry + seg_begin;
+                 task_frame(current_process)->eip = head->e_entry + seg_begin;
             }
         }
         prgm_head++;
     }
+    kfree(phdrs);
+    kfree(head);
+    if(brk_start)
+        current_process->brk_start = current_process->brk = brk_start;
 
-    // Setup stack and eip again
+    // Setup stack, the user mode registers already point at it
     allocate_page(current_process->page_dir, 0xC0000000 - 0x1000, 0, 0, 1);
-    current_process->regs.esp = 0xC0000000;
-    current_process->regs.ebp = current_process->regs.ebp;
-    // Ready to run
+    // Ready to run, returning goes to task_entry_user, which enters the program
     current_process->state = TASK_RUNNING;
-    // Schedule
-    asm volatile("mov $1, %eax");
-    asm volatile("int $0x80");
+    unlock_kernel();
 }
@@ -0,0 +1,72 @@
+#include <dma.h>
+#include <paging.h>
+#include <pmm.h>
+#include <string.h>
+#include <serial.h>
+
+/*
+ * The pool is one buddy block, so virtual and physical addresses in it differ by a constant
+ * It's carved up in DMA_CHUNK_SIZE chunks, a bit per chunk tells whether it's in use
+ * */
+
+static uint32_t dma_pool_phys;
+static uint8_t dma_used[DMA_POOL_CHUNKS / 8];
+
+#define DMA_ISSET(i)    ((dma_used[(i) / 8] >> ((i) % 8)) & 0x1)
+#define DMA_SETBIT(i)   (dma_used[(i) / 8] |= (1 << ((i) % 8)))
+#define DMA_CLEARBIT(i) (dma_used[(i) / 8] &= ~(1 << ((i) % 8)))
+
+/*
+ * Reserve the pool and map it, must be done before any process is created(every address space links the kernel's page tables when it's created)
+ * */
+void dma_init() {
+    uint32_t blk = pmm_alloc_pages(DMA_POOL_ORDER);
+    if(blk == (uint32_t)-1)
+        PANIC("dma_init: no contiguous memory for the dma pool");
+    dma_pool_phys = blk * PAGE_SIZE;
+    for(uint32_t i = 0; i < (1 << DMA_POOL_ORDER); i++)
+        allocate_page(kpage_dir, DMA_POOL_START + i * PAGE_SIZE, blk + i, 1, 1);
+    memset(dma_used, 0, sizeof(dma_used));
+}
+
+/*
+ * Allocate size bytes of physically contiguous memory, the physical address goes to *phys
+ * A buffer of at most a page never crosses a page boundary, bigger ones start on one, so either way a device never sees a gap
+ * */
+void * dma_alloc(uint32_t size, uint32_t * phys) {
+    uint32_t n = (size + DMA_CHUNK_SIZE - 1) / DMA_CHUNK_SIZE;
+    // Where a run may start: anywhere as long as it stays in the page, or only at page boundaries
+    uint32_t step = (size > PAGE_SIZE) ? PAGE_SIZE / DMA_CHUNK_SIZE : 1;
+    if(!n) n = 1;
+    for(uint32_t start = 0; start + n <= DMA_POOL_CHUNKS; start += step) {
+        if(size <= PAGE_SIZE && (start * DMA_CHUNK_SIZE) / PAGE_SIZE != ((start + n) * DMA_CHUNK_SIZE - 1) / PAGE_SIZE)
+            continue;
+        uint32_t i = 0;
+        while(i < n && !DMA_ISSET(start + i))
+            i++;
+        if(i < n) {
+            // Skip past the chunk in use
+            if(step == 1)
+                start += i;
+            continue;
+        }
+        for(i = 0; i < n; i++)
+            DMA_SETBIT(start + i);
+        if(phys)
+            *phys = dma_pool_phys + start * DMA_CHUNK_SIZE;
+        return (void*)(DMA_POOL_START + start * DMA_CHUNK_SIZE);
+    }
+    qemu_printf("dma_alloc: pool exhausted(%u bytes requested)\n", size);
+    return NULL;
+}
+
+/*
+ * Give back a buffer from dma_alloc, size must be the size it was allocated with
+ * */
+void dma_free(void * ptr, uint32_t size) {
+    uint32_t start = ((uint32_t)ptr - DMA_POOL_START) / DMA_CHUNK_SIZE;
+    uint32_t n = (size + DMA_CHUNK_SIZE - 1) / DMA_CHUNK_SIZE;
+    if(!n) n = 1;
+    for(uint32_t i = 0; i < n; i++)
+        DMA_CLEARBIT(start + i);
+}
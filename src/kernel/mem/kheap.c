@@ -5,6 +5,8 @@
 #include <kheap.h>
 #include <system.h>
 #include <math.h>
+#include <timer.h>
+#include <pmm.h>
 
 // // kheap.h -- Interface for kernel heap functions, also provides
 //            a placement malloc() for use before the heap is
@@ -15,7 +17,31 @@
 
 struct Block * head = NULL;       // First memory block
 struct Block * tail = NULL;	  // Last memory block
-struct Block * freelist = NULL;	  // All the memory blocks that are freed
+// Free blocks are kept in segregated lists, bins[i] holds the free blocks with size in [2^i, 2^(i+1))
+struct Block * bins[KHEAP_NUM_BINS];
+// Bit i is set when bins[i] is not empty
+uint32_t bin_bitmap = 0;
+// Search every bin for the best fit, this is what the old single freelist did(only used by kheap_benchmark)
+static int linear_search = 0;
+
+// Allocation trace, see kheap_trace_start()
+static kheap_trace_t * trace = NULL;
+static uint32_t trace_len = 0;
+static uint32_t trace_cap = 0;
+// How many operations the trace buffer has room for, trace_cap drops to 0 when recording stops but the buffer stays
+static uint32_t trace_size = 0;
+
+/*
+ * Append one kmalloc/kfree/krealloc to the allocation trace, if we're recording one
+ * */
+static void trace_record(uint32_t op, void * ptr, void * old, uint32_t size) {
+    if(trace_len >= trace_cap) return;
+    trace[trace_len].op = op;
+    trace[trace_len].ptr = ptr;
+    trace[trace_len].old = old;
+    trace[trace_len].size = size;
+    trace_len++;
+}
 
 
 void * heap_start;    // Where heap starts (must be page-aligned)
@@ -24,6 +50,24 @@ void * heap_curr;     // Top of heap
 void * heap_max;      // Maximum heap_end
 
 int kheap_enabled = 0;
+
+// Trim the heap when at least this many bytes at the end can be given back, 0 turns trimming off
+uint32_t trim_threshold = KHEAP_TRIM_THRESHOLD;
+// How many bytes kheap_trim() has given back to the pmm so far
+uint32_t reclaimed_bytes = 0;
+// How much kheap_trim() has shrunk the heap by, trims inside a 4mb page unmap nothing and give nothing back(see free_page)
+uint32_t trimmed_bytes = 0;
+
+// Allocation statistics, per call site of the kmalloc family, see kheap_print_stats()
+kheap_site_t sites[KHEAP_MAX_SITES];
+// Allocations whose call site didn't fit in sites[]
+uint32_t untracked_allocs = 0;
+// Request sizes, size_histogram[i] counts requests with size in [2^i, 2^(i+1))
+uint32_t size_histogram[KHEAP_NUM_BINS];
+uint32_t live_bytes = 0;
+uint32_t peak_live_bytes = 0;
+// Prints the statistics periodically, see kheap_stats_periodic()
+ktimer_t stats_timer;
 // Defined in paging.c
 extern page_directory_t *kpage_dir;
 
@@ -35,6 +79,57 @@ extern void * heap_start, * heap_end, * heap_max, * heap_curr;
 
 uint32_t placement_address = (uint32_t)&end;
 
+/*
+ * Charge a new allocation to the code that asked for it
+ * An allocated block doesn't use its prev field(it's only for the freelist), so the site index is kept there, tagged with KHEAP_SITE_TAG
+ * */
+static void site_account_alloc(void * ptr, uint32_t request, void * caller) {
+    if(!ptr) return;
+    struct Block * b = ptr - sizeof(struct Block);
+    uint32_t size = getRealSize(b->size);
+    size_histogram[getBin(request)]++;
+    live_bytes += size;
+    if(live_bytes > peak_live_bytes)
+        peak_live_bytes = live_bytes;
+
+    // Open addressing on the caller's address
+    uint32_t idx = ((uint32_t)caller >> 2) % KHEAP_MAX_SITES;
+    uint32_t i;
+    for(i = 0; i < KHEAP_MAX_SITES; i++) {
+        if(sites[idx].caller == caller || sites[idx].caller == NULL)
+            break;
+        idx = (idx + 1) % KHEAP_MAX_SITES;
+    }
+    if(i == KHEAP_MAX_SITES) {
+        untracked_allocs++;
+        // Still tagged, so site_account_free() takes its bytes off live_bytes again
+        b->prev = (void*)(KHEAP_SITE_TAG | KHEAP_SITE_UNTRACKED);
+        return;
+    }
+    kheap_site_t * site = &sites[idx];
+    site->caller = caller;
+    site->allocs++;
+    site->live_bytes += size;
+    if(site->live_bytes > site->peak_bytes)
+        site->peak_bytes = site->live_bytes;
+    b->prev = (void*)(KHEAP_SITE_TAG | idx);
+}
+
+/*
+ * Give the bytes of a block back to the site that allocated it, blocks from plain malloc() calls have no tag and are skipped
+ * */
+static void site_account_free(struct Block * b) {
+    uint32_t tag = (uint32_t)b->prev;
+    if((tag & 0xFFFF0000) != KHEAP_SITE_TAG) return;
+    uint32_t size = getRealSize(b->size);
+    live_bytes -= size;
+    b->prev = NULL;
+    if((tag & 0xFFFF) == KHEAP_SITE_UNTRACKED) return;
+    kheap_site_t * site = &sites[tag & 0xFFFF];
+    site->frees++;
+    site->live_bytes -= size;
+}
+
 void * kmalloc_cont(uint32_t sz, int align, uint32_t *phys) {
 
     if (align == 1 && (placement_address & 0xFFFFF000) )
@@ -59,13 +154,16 @@ void * kmalloc_cont(uint32_t sz, int align, uint32_t *phys) {
 align: return a page-aligned memory block
 phys: return the physical address of the memory block
 */
-uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys)
+static uint32_t kmalloc_site(uint32_t sz, int align, uint32_t *phys, void * caller)
 {
     if (heap_start != NULL)
     {
+        uint32_t request = sz;
         // This will guarantee a block that's enough for data of size sz and aligned to 4kb boundary
         if(align) sz = sz + 4096;
         void * addr = malloc(sz);
+        trace_record(TRACE_ALLOC, addr, NULL, sz);
+        site_account_alloc(addr, request, caller);
         uint32_t align_addr = ((uint32_t)addr & 0xFFFFF000) + 0x1000;
         if (phys != 0)
         {
@@ -102,12 +200,17 @@ uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys)
     }
 }
 
+uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys)
+{
+    return kmalloc_site(sz, align, phys, __builtin_return_address(0));
+}
+
 /*
    kmalloc, align
    */
 void * kmalloc_a(uint32_t sz)
 {
-    return kmalloc_int(sz, 1, 0);
+    return (void*)kmalloc_site(sz, 1, 0, __builtin_return_address(0));
 }
 
 /*
@@ -115,7 +218,7 @@ void * kmalloc_a(uint32_t sz)
    */
 uint32_t kmalloc_p(uint32_t sz, uint32_t *phys)
 {
-    return kmalloc_int(sz, 0, phys);
+    return kmalloc_site(sz, 0, phys, __builtin_return_address(0));
 }
 
 /*
@@ -123,7 +226,7 @@ uint32_t kmalloc_p(uint32_t sz, uint32_t *phys)
    */
 uint32_t kmalloc_ap(uint32_t sz, uint32_t *phys)
 {
-    return kmalloc_int(sz, 1, phys);
+    return kmalloc_site(sz, 1, phys, __builtin_return_address(0));
 }
 
 /*
@@ -131,7 +234,7 @@ uint32_t kmalloc_ap(uint32_t sz, uint32_t *phys)
    */
 void * kmalloc(uint32_t sz)
 {
-    return (void*)kmalloc_int(sz, 0, 0);
+    return (void*)kmalloc_site(sz, 0, 0, __builtin_return_address(0));
 }
 
 
@@ -140,6 +243,8 @@ void * kmalloc(uint32_t sz)
    */
 void *kcalloc(uint32_t num, uint32_t size) {
     void * ptr = malloc(num * size);
+    trace_record(TRACE_ALLOC, ptr, NULL, num * size);
+    site_account_alloc(ptr, num * size, __builtin_return_address(0));
     memset(ptr, 0, num*size);
     return ptr;
 }
@@ -148,13 +253,19 @@ void *kcalloc(uint32_t num, uint32_t size) {
    */
 void * krealloc(void * ptr, uint32_t size) {
     // TODO: optimize realloc, for now, just simeply malloc and move data over
-    return realloc(ptr, size);
+    if(ptr)
+        site_account_free(ptr - sizeof(struct Block));
+    void * ret = realloc(ptr, size);
+    trace_record(TRACE_REALLOC, ret, ptr, size);
+    site_account_alloc(ret, size, __builtin_return_address(0));
+    return ret;
 }
 
 /*
    wrapper function for free
    */
 void kfree(void * ptr) {
+    trace_record(TRACE_FREE, NULL, ptr, 0);
     free(ptr);
 }
 /*
@@ -165,6 +276,8 @@ void kheap_init(void * start, void * end, void * max) {
     heap_end = end;
     heap_max = max;
     heap_curr = start;
+    memset(bins, 0, sizeof(bins));
+    bin_bitmap = 0;
     kheap_enabled = 1;
 }
 
@@ -200,12 +313,15 @@ void db_print() {
     qemu_printf("\n total usable bytes: %d", total);
     qemu_printf("\n total overhead bytes: %d", total_overhead);
     qemu_printf("\n total bytes: %d", total + total_overhead);
-    qemu_printf("\nfreelist: ");
-
-    struct Block * ite = freelist;
-    while(ite) {
-        qemu_printf("(%p)->", ite);
-        ite = ite->next;
+    qemu_printf("\n bytes given back to pmm: %u(heap trimmed by %u)", reclaimed_bytes, trimmed_bytes);
+    for(uint32_t i = 0; i < KHEAP_NUM_BINS; i++) {
+        if(!bins[i]) continue;
+        qemu_printf("\nbin %u: ", i);
+        struct Block * ite = bins[i];
+        while(ite) {
+            qemu_printf("(%p)->", ite);
+            ite = ite->next;
+        }
     }
     qemu_printf("\n\n");
     return;
@@ -267,9 +383,18 @@ int isFree(struct Block * n) {
     if(!n) return 0;
     return (n->size & 0x1);
 }
+/*
+ * Which bin does a block of this size belong to, floor(log2(size))
+ * */
+uint32_t getBin(uint32_t size) {
+    size = getRealSize(size);
+    if(size == 0) return 0;
+    return 31 - __builtin_clz(size);
+}
+
 /*
  * Remove the node from freelist
- *
+ * A block's size may already be changed when it's removed, so if it's the head of a bin, look for the bin that really points to it
  * */
 
 void removeNodeFromFreelist(struct Block * x) {
@@ -278,35 +403,45 @@ void removeNodeFromFreelist(struct Block * x) {
         x->prev->next = x->next;
         if(x->next)
             x->next->prev = x->prev;
+        return;
     }
-    else {
-        freelist = x->next;
-        if(freelist)
-            freelist->prev = NULL;
+    uint32_t bin = getBin(x->size);
+    if(bins[bin] != x) {
+        uint32_t mask = bin_bitmap;
+        while(mask) {
+            bin = __builtin_ctz(mask);
+            if(bins[bin] == x) break;
+            mask = mask & (mask - 1);
+        }
+        // Not in any bin
+        if(!mask) return;
     }
+    bins[bin] = x->next;
+    if(bins[bin])
+        bins[bin]->prev = NULL;
+    else
+        bin_bitmap = bin_bitmap & ~(1 << bin);
 }
 /*
- * Insert the node to freelist
+ * Insert the node to the front of the bin for its size
  *
  * */
 void addNodeToFreelist(struct Block * x) {
     if(!x) return;
-    x->next = freelist;
-    if(freelist)
-        freelist->prev = x;
-    freelist = x;
-    freelist->prev = NULL;
+    uint32_t bin = getBin(x->size);
+    x->next = bins[bin];
+    if(bins[bin])
+        bins[bin]->prev = x;
+    bins[bin] = x;
+    x->prev = NULL;
+    bin_bitmap = bin_bitmap | (1 << bin);
 }
 
 /*
- * Find the bestfit block in the memory pool
- * 找最小适合
+ * Best fit within a single bin
  * */
-// // struct Block: size|prev|next;
-struct Block * bestfit(uint32_t size) {
-    // extend this, may be, optimize for certain size of type
-    if(!freelist) return NULL;
-    struct Block * curr = freelist;
+static struct Block * bestfit_in_bin(uint32_t bin, uint32_t size) {
+    struct Block * curr = bins[bin];
     struct Block * currBest = NULL;
     while(curr) {
         if(doesItFit(curr, size)) {
@@ -315,7 +450,33 @@ struct Block * bestfit(uint32_t size) {
         }
         curr = curr ->next;
     }
-    return currBest;;
+    return currBest;
+}
+
+/*
+ * Find the bestfit block in the memory pool
+ * 找最小适合
+ * Blocks in the request's own bin may be too small, so search it for the best fit first.
+ * Any block in a higher bin fits, so if that fails, the smallest block of the next non-empty bin is the best fit.
+ * */
+// // struct Block: size|prev|next;
+struct Block * bestfit(uint32_t size) {
+    uint32_t bin = getBin(size);
+    if(linear_search) {
+        struct Block * currBest = NULL;
+        for(uint32_t i = 0; i < KHEAP_NUM_BINS; i++) {
+            struct Block * t = bestfit_in_bin(i, size);
+            if(t && (currBest == NULL || t->size < currBest->size))
+                currBest = t;
+        }
+        return currBest;
+    }
+    struct Block * currBest = bestfit_in_bin(bin, size);
+    if(currBest || bin + 1 >= KHEAP_NUM_BINS)
+        return currBest;
+    uint32_t mask = bin_bitmap & (0xffffffff << (bin + 1));
+    if(!mask) return NULL;
+    return bestfit_in_bin(__builtin_ctz(mask), size);
 }
 
 /*
@@ -403,6 +564,8 @@ void *malloc(uint32_t size) {
 
     uint32_t * trailingSize = NULL;
     if(best) {
+        // Unlink it before its size changes, so we know which bin it's in
+        removeNodeFromFreelist(best);
         // and! put a SIZE to the last four byte of the chunk
         // and! put a SIZE to the last four byte of the chunk
         // and! put a SIZE to the last four byte of the chunk
@@ -475,7 +638,6 @@ void *malloc(uint32_t size) {
         }
 noSplit:
         // return it!
-        removeNodeFromFreelist(base);
         // 有效空间开始地址  
         return base + sizeof(struct Block);
     }
@@ -539,8 +701,11 @@ void free(void *ptr) {
     struct Block * curr = ptr - sizeof(struct Block);
     struct Block * prev = getPrevBlock(curr);
     struct Block * next = getNextBlock(curr);
+    site_account_free(curr);
 
     if(isFree(prev) && isFree(next)) {
+        // prev grows, so it has to move to another bin
+        removeNodeFromFreelist(prev);
         prev->size = getRealSize(prev->size) + 2*OVERHEAD + getRealSize(curr->size) + getRealSize(next->size);
         setFree(&(prev->size), 1);
         // 最后设置下一个大小
@@ -549,13 +714,16 @@ void free(void *ptr) {
         // if next used to be tail, set prev = tail
         if(tail == next) tail = prev;
         removeNodeFromFreelist(next);
+        addNodeToFreelist(prev);
     }
     else if(isFree(prev)) {
+        removeNodeFromFreelist(prev);
         prev->size = getRealSize(prev->size) + OVERHEAD + getRealSize(curr->size);
         setFree(&(prev->size), 1);
         uint32_t * trailingSize = (void*)prev + sizeof(struct Block) + getRealSize(prev->size);
         *trailingSize = prev->size;
         if(tail == curr) tail = prev;
+        addNodeToFreelist(prev);
     }
     else if(isFree(next)) {
         // change size to curr's size + OVERHEAD + next's size
@@ -574,6 +742,62 @@ void free(void *ptr) {
         *trailingSize = curr->size;
         addNodeToFreelist(curr);
     }
+    kheap_trim();
+}
+
+/*
+ * If the last block is free and enough memory could be released, shrink the heap with ksbrk so the pages at the end go back to the pmm
+ * The heap never shrinks below HEAP_MIN_SIZE, and the part of the last block that shares a page with the block before it stays in the heap
+ * With more than one cpu ksbrk keeps the pages mapped, so nothing goes back to the pmm then
+ * */
+void kheap_trim() {
+    if(!trim_threshold || !tail || !isFree(tail)) return;
+    uint32_t start = (uint32_t)tail;
+    uint32_t cut = ALIGN(start, PAGE_SIZE);
+    // What's left of the last block must still be big enough to be a block
+    if(cut != start && cut - start < OVERHEAD + 8)
+        cut = cut + PAGE_SIZE;
+    if(cut < (uint32_t)heap_start + HEAP_MIN_SIZE)
+        cut = (uint32_t)heap_start + HEAP_MIN_SIZE;
+    if(cut >= (uint32_t)heap_curr || (uint32_t)heap_end - cut < trim_threshold)
+        return;
+
+    struct Block * last = tail;
+    removeNodeFromFreelist(last);
+    if(cut == start) {
+        // The whole block goes away
+        if(last == head)
+            head = tail = NULL;
+        else
+            tail = getPrevBlock(last);
+    }
+    else {
+        last->size = cut - start - OVERHEAD;
+        setFree(&(last->size), 1);
+        uint32_t * trailingSize = (void*)last + sizeof(struct Block) + getRealSize(last->size);
+        *trailingSize = last->size;
+        addNodeToFreelist(last);
+    }
+    uint32_t old_heap_end = (uint32_t)heap_end;
+    uint32_t old_used = pmm_used_blocks();
+    ksbrk(-((uint32_t)heap_curr - cut));
+    trimmed_bytes += old_heap_end - (uint32_t)heap_end;
+    // Only count the frames that really went back
+    reclaimed_bytes += (old_used - pmm_used_blocks()) * PAGE_SIZE;
+}
+
+/*
+ * Change how much memory has to be free at the end of the heap before free() trims it, 0 turns trimming off
+ * */
+void kheap_set_trim_threshold(uint32_t bytes) {
+    trim_threshold = bytes;
+}
+
+/*
+ * Total bytes given back to the pmm by kheap_trim()
+ * */
+uint32_t kheap_reclaimed_bytes() {
+    return reclaimed_bytes;
 }
 
 /*
@@ -689,9 +913,228 @@ void *realloc(void *ptr, uint32_t size) {
         setFree(&(splitBlock->size), 1);
         trailingSize = (void*) splitBlock + sizeof(struct Block) + getRealSize(splitBlock->size);
         *trailingSize = splitBlock->size;
+        if(tail == nptr) {
+            tail = splitBlock;
+        }
         // add this mo** f**r to the freelist!
         addNodeToFreelist(splitBlock);
 
         return ptr;
     }
 }
+
+/*
+ * Start recording the next max_ops kmalloc/kfree/krealloc calls, kheap_benchmark() replays them
+ * */
+void kheap_trace_start(uint32_t max_ops) {
+    // Don't record our own malloc/free
+    trace_cap = 0;
+    trace_len = 0;
+    if(trace && trace_size < max_ops) {
+        free(trace);
+        trace = NULL;
+        trace_size = 0;
+    }
+    if(!trace) {
+        trace = malloc(max_ops * sizeof(kheap_trace_t));
+        if(!trace) {
+            qemu_printf("kheap_trace_start: no memory for %u operations\n", max_ops);
+            return;
+        }
+        trace_size = max_ops;
+    }
+    trace_cap = max_ops;
+}
+
+/*
+ * When nothing was recorded, make up a trace that looks like what the kernel does: lots of small list nodes and inodes, some sector/block buffers and a few page aligned allocations
+ * */
+static void trace_generate(uint32_t n) {
+    static uint32_t sizes[] = {12, 12, 12, 16, 24, 40, 128, 128, 128, 300, 512, 512, 1024, 1024, 4096 + 4096, 20000};
+    uint32_t seed = 12345;
+    uint32_t live = 0;
+    // Which generated allocations have already been freed
+    uint8_t * dead = malloc(n);
+    if(!dead)
+        return;
+    memset(dead, 0, n);
+    kheap_trace_start(n);
+    if(!trace) {
+        free(dead);
+        return;
+    }
+    for(uint32_t i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 16;
+        // Free a random earlier allocation 45% of the time, so the heap keeps growing slowly and fragments
+        if(live > 0 && r % 100 < 45) {
+            uint32_t j = r % i;
+            while(trace[j].op != TRACE_ALLOC || dead[j])
+                j = (j + 1) % i;
+            dead[j] = 1;
+            trace_record(TRACE_FREE, NULL, trace[j].ptr, 0);
+            live--;
+            continue;
+        }
+        // The pointers are just unique tokens, the replay only uses them to match frees with allocations
+        trace_record(TRACE_ALLOC, (void*)(i + 1), NULL, sizes[r % (sizeof(sizes) / sizeof(uint32_t))]);
+        live++;
+    }
+    free(dead);
+}
+
+/*
+ * Size of all free blocks, the largest free block and how many free blocks there are
+ * */
+void kheap_free_stats(uint32_t * free_bytes, uint32_t * largest, uint32_t * num_free) {
+    *free_bytes = 0;
+    *largest = 0;
+    *num_free = 0;
+    for(uint32_t i = 0; i < KHEAP_NUM_BINS; i++) {
+        for(struct Block * b = bins[i]; b; b = b->next) {
+            uint32_t size = getRealSize(b->size);
+            *free_bytes += size;
+            if(size > *largest) *largest = size;
+            (*num_free)++;
+        }
+    }
+}
+
+/*
+ * External fragmentation: how much of the free memory is not in the largest free block, in percent
+ * */
+uint32_t kheap_fragmentation(uint32_t free_bytes, uint32_t largest) {
+    if(!free_bytes) return 0;
+    return 100 - largest / (free_bytes / 100 + 1);
+}
+
+/*
+ * Replay the trace once, print how long it took and how fragmented the heap is at the end
+ * src[i] is the index of the operation that produced the pointer op i frees/reallocs
+ * */
+static void trace_replay(char * name, int * src, void ** ptrs) {
+    uint32_t heap_before = (uint32_t)heap_curr;
+    uint64_t t = rdtsc();
+    for(uint32_t i = 0; i < trace_len; i++) {
+        ptrs[i] = NULL;
+        if(trace[i].op == TRACE_ALLOC || (trace[i].op == TRACE_REALLOC && !trace[i].old)) {
+            ptrs[i] = malloc(trace[i].size);
+        }
+        else if(src[i] >= 0 && ptrs[src[i]]) {
+            if(trace[i].op == TRACE_FREE)
+                free(ptrs[src[i]]);
+            else
+                ptrs[i] = realloc(ptrs[src[i]], trace[i].size);
+            ptrs[src[i]] = NULL;
+        }
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - t);
+
+    uint32_t free_bytes, largest, num_free;
+    kheap_free_stats(&free_bytes, &largest, &num_free);
+    uint32_t frag = kheap_fragmentation(free_bytes, largest);
+    qemu_printf("  %s: %u cycles per op, heap grew %u bytes, %u free blocks, %u free bytes, largest %u, fragmentation %u/100\n",
+            name, cycles / trace_len, (uint32_t)heap_curr - heap_before, num_free, free_bytes, largest, frag);
+
+    for(uint32_t i = 0; i < trace_len; i++) {
+        if(ptrs[i]) free(ptrs[i]);
+    }
+}
+
+/*
+ * Replay the recorded allocation trace(or a made up one) with the segregated bins, and with a search over every free block like the old single freelist did
+ * */
+void kheap_benchmark() {
+    // Stop recording
+    trace_cap = 0;
+    if(!trace || trace_len == 0)
+        trace_generate(KHEAP_BENCHMARK_OPS);
+    trace_cap = 0;
+    if(!trace || trace_len == 0) {
+        qemu_printf("kheap benchmark: no trace to replay\n");
+        return;
+    }
+
+    // Match every free/realloc with the latest allocation that returned the same pointer, frees of memory allocated before recording started are dropped
+    int * src = malloc(trace_len * sizeof(int));
+    void ** ptrs = malloc(trace_len * sizeof(void*));
+    if(!src || !ptrs) {
+        qemu_printf("kheap benchmark: out of memory\n");
+        if(src) free(src);
+        if(ptrs) free(ptrs);
+        return;
+    }
+    for(uint32_t i = 0; i < trace_len; i++) {
+        src[i] = -1;
+        if(trace[i].op == TRACE_ALLOC || !trace[i].old) continue;
+        for(int j = i - 1; j >= 0; j--) {
+            if(trace[j].op != TRACE_FREE && trace[j].ptr == trace[i].old) {
+                src[i] = j;
+                break;
+            }
+        }
+    }
+
+    // Don't trim while replaying, so both runs start from the same heap
+    uint32_t save_threshold = trim_threshold;
+    trim_threshold = 0;
+    qemu_printf("kheap benchmark(replaying %u operations):\n", trace_len);
+    trace_replay("segregated bins", src, ptrs);
+    linear_search = 1;
+    trace_replay("linear best fit", src, ptrs);
+    linear_search = 0;
+    trim_threshold = save_threshold;
+
+    free(src);
+    free(ptrs);
+    free(trace);
+    trace = NULL;
+    trace_len = 0;
+    trace_size = 0;
+    kheap_trim();
+}
+
+/*
+ * Dump heap statistics to the serial port: totals, free memory and fragmentation, request size histogram, and what every call site still holds
+ * A site that keeps allocating more than it frees is a good place to look for leaks
+ * */
+void kheap_print_stats() {
+    uint32_t free_bytes, largest, num_free;
+    kheap_free_stats(&free_bytes, &largest, &num_free);
+    qemu_printf("kheap: heap size %u, %u bytes live(peak %u), %u bytes given back to pmm(heap trimmed by %u)\n", (uint32_t)heap_curr - (uint32_t)heap_start,
+            live_bytes, peak_live_bytes, reclaimed_bytes, trimmed_bytes);
+    qemu_printf("  %u free blocks, %u free bytes, largest free block %u, fragmentation %u/100\n", num_free, free_bytes, largest,
+            kheap_fragmentation(free_bytes, largest));
+
+    qemu_printf("  request sizes:\n");
+    for(uint32_t i = 0; i < KHEAP_NUM_BINS; i++) {
+        if(size_histogram[i])
+            qemu_printf("    %u - %u bytes: %u\n", 1 << i, (2 << i) - 1, size_histogram[i]);
+    }
+
+    qemu_printf("  call sites(caller: live bytes, peak bytes, allocs, frees, outstanding):\n");
+    for(uint32_t i = 0; i < KHEAP_MAX_SITES; i++) {
+        kheap_site_t * site = &sites[i];
+        if(!site->caller) continue;
+        qemu_printf("    0x%p: %u, %u, %u, %u, %u\n", site->caller, site->live_bytes, site->peak_bytes, site->allocs, site->frees,
+                site->allocs - site->frees);
+    }
+    if(untracked_allocs)
+        qemu_printf("  %u allocations from call sites that didn't fit in the table\n", untracked_allocs);
+}
+
+static void kheap_stats_tick(void * data) {
+    kheap_print_stats();
+}
+
+/*
+ * Print the heap statistics every sec seconds, 0 stops it
+ * */
+void kheap_stats_periodic(uint32_t sec) {
+    if(!sec) {
+        timer_cancel(&stats_timer);
+        return;
+    }
+    timer_setup(&stats_timer, kheap_stats_tick, NULL);
+    timer_start(&stats_timer, TIMER_SEC(sec), TIMER_SEC(sec));
+}
@@ -0,0 +1,56 @@
+#include <page_cache.h>
+#include <slab.h>
+#include <pmm.h>
+
+static page_cache_entry_t * buckets[PAGE_CACHE_BUCKETS];
+static kmem_cache_t * entry_cache;
+
+static uint32_t page_cache_hash(vfs_node_t * file, uint32_t page_idx) {
+    return ((uint32_t)file->device ^ (file->inode_num * 31) ^ page_idx) % PAGE_CACHE_BUCKETS;
+}
+
+/*
+ * The frame holding page_idx of file, 0 if it's not cached
+ * */
+uint32_t page_cache_find(vfs_node_t * file, uint32_t page_idx) {
+    for(page_cache_entry_t * e = buckets[page_cache_hash(file, page_idx)]; e; e = e->next) {
+        if(e->device == file->device && e->inode_num == file->inode_num && e->page_idx == page_idx)
+            return e->frame;
+    }
+    return 0;
+}
+
+/*
+ * Cache a frame that holds page_idx of file, the cache takes over the caller's reference to the frame
+ * */
+void page_cache_insert(vfs_node_t * file, uint32_t page_idx, uint32_t frame) {
+    if(!entry_cache)
+        entry_cache = kmem_cache_create("page_cache_entry_t", sizeof(page_cache_entry_t));
+    uint32_t h = page_cache_hash(file, page_idx);
+    page_cache_entry_t * e = kmem_cache_alloc(entry_cache);
+    e->device = file->device;
+    e->inode_num = file->inode_num;
+    e->page_idx = page_idx;
+    e->frame = frame;
+    e->next = buckets[h];
+    buckets[h] = e;
+}
+
+/*
+ * Forget every cached page of file, the frames are freed once nobody maps them anymore
+ * */
+void page_cache_invalidate(vfs_node_t * file) {
+    for(uint32_t i = 0; i < PAGE_CACHE_BUCKETS; i++) {
+        page_cache_entry_t ** link = &buckets[i];
+        while(*link) {
+            page_cache_entry_t * e = *link;
+            if(e->device == file->device && e->inode_num == file->inode_num) {
+                *link = e->next;
+                free_block(e->frame);
+                kmem_cache_free(entry_cache, e);
+                continue;
+            }
+            link = &e->next;
+        }
+    }
+}
@@ -6,32 +6,211 @@
 #include <pmm.h>
 #include <kheap.h>
 #include <vga.h>
+#include <process.h>
+#include <page_cache.h>
 
 // Defined in kheap.c
 extern void * heap_start, * heap_end, * heap_max, * heap_curr;
-extern int kheap_enabled;
 
 // Where we want to place all the paging structure data
 uint8_t * temp_mem;
 int paging_enabled = 0;
 
 page_directory_t * kpage_dir;
+// Where the kernel's directory can be reached, it sits in the kernel's first 4mb
+static page_directory_t * kpage_dir_virt;
+
+// Bumped whenever a page directory or page table frame is given back, see map_foreign()
+static uint32_t window_generation;
+
+// Map the kernel, the initial heap and the framebuffer with 4mb pages(see paging_init)
+int large_pages = 0;
+
+// Scratch space for duplicating a frame on a copy on write fault
+static uint8_t cow_buffer[PAGE_SIZE];
+
+// Zeroed page table frames, see alloc_table_frame()
+static uint32_t table_cache[PAGE_TABLE_CACHE_SIZE];
+static uint32_t table_cache_count;
+
+static void set_dir_entry(page_dir_entry_t * pde, uint32_t frame, int user) {
+    memset(pde, 0, sizeof(page_dir_entry_t));
+    pde->frame = frame;
+    pde->present = 1;
+    pde->rw = 1;
+    pde->user = user;
+}
+
+/*
+ * Point the loaded address space's window at another page directory
+ * The entry alone doesn't tell whether this cpu's tlb agrees with it: every cpu running a kernel thread shares the kernel's directory(and its window),
+ * and a directory's frame may come back as another directory once it's freed. So the window is only trusted if this cpu flushed it itself,
+ * since cr3 was last loaded, and no directory or page table was freed since
+ * */
+static void map_foreign(uint32_t phys) {
+    page_dir_entry_t * pde = &PAGE_DIRECTORY->tables[FOREIGN_PDE];
+    cpu_t * c = this_cpu();
+    if(pde->present && pde->frame == (phys >> 12) && c->window == phys && c->window_generation == window_generation)
+        return;
+    set_dir_entry(pde, phys >> 12, 0);
+    // Every page of the window may have changed, drop them all(kernel pages are global and stay)
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    c->window = phys;
+    c->window_generation = window_generation;
+}
+
+/*
+ * Close the loaded address space's window, if it shows the directory at phys
+ * */
+static void unmap_foreign(uint32_t phys) {
+    page_dir_entry_t * pde = &PAGE_DIRECTORY->tables[FOREIGN_PDE];
+    if(!pde->present || pde->frame != (phys >> 12))
+        return;
+    memset(pde, 0, sizeof(page_dir_entry_t));
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    this_cpu()->window = 0;
+}
+
+/*
+ * Get to the entries of a page directory, a page_directory_t * names a directory by its physical address(what goes into cr3), it isn't mapped anywhere by itself
+ * The kernel's directory is in the kernel's first 4mb, the loaded one shows up at PAGE_DIRECTORY through the recursive mapping, any other one through the foreign window
+ * What's returned for a foreign directory is only good until the window is pointed somewhere else, don't keep it across calls that may do that(table_of() on another directory)
+ * */
+static page_directory_t * dir_entries(page_directory_t * dir) {
+    if(dir == kpage_dir)
+        return kpage_dir_virt;
+    if(!paging_enabled)
+        return (page_directory_t*)((uint32_t)dir + LOAD_MEMORY_ADDRESS);
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    if((uint32_t)dir == cr3)
+        return PAGE_DIRECTORY;
+    map_foreign((uint32_t)dir);
+    return FOREIGN_DIRECTORY;
+}
+
+/*
+ * Get to the page table behind a present, 4kb page directory entry
+ * Tables the loaded address space shares(kernel tables, or all of them if dir is loaded) are right there in the recursive mapping,
+ * others are reached through the foreign window. Before paging is enabled, tables come from dumb_kmalloc and sit in the first 4mb
+ * */
+static page_table_t * table_of(page_directory_t * dir, uint32_t page_dir_idx) {
+    uint32_t frame = dir_entries(dir)->tables[page_dir_idx].frame;
+    if(!paging_enabled)
+        return (page_table_t*)((frame << 12) + LOAD_MEMORY_ADDRESS);
+    page_dir_entry_t * loaded = &PAGE_DIRECTORY->tables[page_dir_idx];
+    if(loaded->present && !loaded->page_size && loaded->frame == frame)
+        return &PAGE_TABLES[page_dir_idx];
+    map_foreign((uint32_t)dir);
+    return &FOREIGN_TABLES[page_dir_idx];
+}
+
+/*
+ * Zero a frame that isn't mapped anywhere, by borrowing the foreign window's page directory entry(its own recursive view is one page)
+ * */
+void paging_zero_frame(uint32_t frame) {
+    page_dir_entry_t * pde = &PAGE_DIRECTORY->tables[FOREIGN_PDE];
+    page_dir_entry_t old = *pde;
+    void * page = &PAGE_TABLES[FOREIGN_PDE];
+    set_dir_entry(pde, frame, 0);
+    asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+    memset(page, 0, PAGE_SIZE);
+    *pde = old;
+    asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+}
+
+/*
+ * Get a frame for a page table, sets *zeroed if it comes from the cache and doesn't need clearing
+ * */
+static uint32_t alloc_table_frame(int * zeroed) {
+    if(table_cache_count) {
+        *zeroed = 1;
+        return table_cache[--table_cache_count];
+    }
+    *zeroed = 0;
+    return allocate_block();
+}
+
+/*
+ * Give back a zeroed page table(or page directory) frame, it's kept for the next page table if the cache has room
+ * Another cpu may still have translations through it in its tlb(a window onto a freed directory), window_generation makes it flush them before it uses its window again
+ * */
+static void free_table_frame(uint32_t frame) {
+    window_generation++;
+    if(table_cache_count < PAGE_TABLE_CACHE_SIZE)
+        table_cache[table_cache_count++] = frame;
+    else
+        free_block(frame);
+}
+
+/*
+ * The resident page counter of the process whose address space dir is, NULL if it's nobody's(the kernel's)
+ * */
+static uint32_t * rss_of(page_directory_t * dir) {
+    if(dir == kpage_dir)
+        return NULL;
+    if(current_process && current_process->page_dir == dir)
+        return &current_process->resident_pages;
+    if(process_list) {
+        foreach(t, process_list) {
+            pcb_t * p = t->val;
+            if(p->page_dir == dir)
+                return &p->resident_pages;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Create the page table for a page directory entry that isn't present yet, NULL if there's no frame left for it
+ * */
+static page_table_t * new_page_table(page_directory_t * dir, uint32_t page_dir_idx) {
+    page_table_t * table;
+    if(!paging_enabled) {
+        // Remember, dumb_kmalloc returns a virtual address, but what we put into the paging structure, MUST BE, in terms of phsical address
+        // Since we've mapped [0 to 4mb physical mem] to [0xc0000000 to 0xc0000000+4mb], we can get the physical addr by subtracting 0xc0000000
+        table = dumb_kmalloc(sizeof(page_table_t), 1);
+        memset(table, 0, sizeof(page_table_t));
+        set_dir_entry(&dir_entries(dir)->tables[page_dir_idx], (uint32_t)virtual2phys(kpage_dir, table) >> 12, 1);
+        return table;
+    }
+    int zeroed;
+    uint32_t frame = alloc_table_frame(&zeroed);
+    if(frame == (uint32_t)-1)
+        return NULL;
+    set_dir_entry(&dir_entries(dir)->tables[page_dir_idx], frame, 1);
+    table = table_of(dir, page_dir_idx);
+    asm volatile("invlpg (%0)" :: "r"(table) : "memory");
+    if(!zeroed)
+        memset(table, 0, sizeof(page_table_t));
+    return table;
+}
 
 /*
  * Convert virtual address to physical address
  * If it's the temp page dir, simply subtract 0xC0000000 since we do the page mapping manually in entry.asm
- * Otherwise, search the whole page table.
+ * Otherwise, look up the page table entry through the recursive mapping
  * */
 void * virtual2phys(page_directory_t * dir, void * virtual_addr) {
     if(!paging_enabled) {
         return (void*)(virtual_addr - LOAD_MEMORY_ADDRESS);
     }
     uint32_t page_dir_idx = PAGEDIR_INDEX(virtual_addr), page_tbl_idx = PAGETBL_INDEX(virtual_addr), page_frame_offset = PAGEFRAME_INDEX(virtual_addr);
-    if(!dir->ref_tables[page_dir_idx]) {
+    page_dir_entry_t pde = dir_entries(dir)->tables[page_dir_idx];
+    if(!pde.present) {
         qemu_printf("virtual2phys: page dir entry does not exist\n");
         return NULL;
     }
-    page_table_t * table = dir->ref_tables[page_dir_idx];
+    if(pde.page_size) {
+        uint32_t t = pde.frame;
+        t = (t << 12) + LARGEPAGE_OFFSET(virtual_addr);
+        return (void*)t;
+    }
+    page_table_t * table = table_of(dir, page_dir_idx);
     if(!table->pages[page_tbl_idx].present) {
         qemu_printf("virtual2phys: page table entry does not exist\n");
         return NULL;
@@ -72,37 +251,29 @@ void allocate_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va,
 /*
  * Allocate a frame from pmm, write frame number to the page structure
  * You may notice that we've set the both the PDE and PTE as user-accessible with r/w permissions, because..... we don't care security
+ * (only the PTE's rw follows is_writable)
+ * Returns 0 if memory ran out(nothing is mapped then)
  * */
-void allocate_page(page_directory_t * dir, uint32_t virtual_addr, uint32_t frame, int is_kernel, int is_writable) {
+int allocate_page(page_directory_t * dir, uint32_t virtual_addr, uint32_t frame, int is_kernel, int is_writable) {
     page_table_t * table = NULL;
     if(!dir) {
         qemu_printf("allocate_page: page directory is empty\n");
-        return;
+        return 0;
     }
     // Ask pmm for a physical block, and assign the physical block to the virtual address,(left shift 12 bits for storing permission info)
     // This looks so much like the code I wrote for the virtual memory lab I wrote in a system programming class :)
     uint32_t page_dir_idx = PAGEDIR_INDEX(virtual_addr), page_tbl_idx = PAGETBL_INDEX(virtual_addr);
-    // If the coressponding page table does not exist, malloc!
-    table = dir->ref_tables[page_dir_idx];
-    if(!table) {
-        if(!kheap_enabled)
-            table = dumb_kmalloc(sizeof(page_table_t), 1);
-        else
-            table = kmalloc_a(sizeof(page_table_t));
-
-        memset(table, 0, sizeof(page_table_t));
-        // Remember, dumb_kmalloc returns a virtual address, but what we put into the paging structure, MUST BE, in terms of phsical address
-        // Since we've mapped [0 to 4mb physical mem] to [0xc0000000 to 0xc0000000+4mb], we can get the physical addr by subtracting 0xc0000000
-
-        uint32_t t = (uint32_t)virtual2phys(kpage_dir, table);
-        dir->tables[page_dir_idx].frame = t >> 12;
-        dir->tables[page_dir_idx].present = 1;
-        dir->tables[page_dir_idx].rw = 1;
-        dir->tables[page_dir_idx].user = 1;
-        dir->tables[page_dir_idx].page_size = 0;
-        // Leave a reference here so that later we can access this table
-        dir->ref_tables[page_dir_idx] = table;
-    }
+    page_dir_entry_t pde = dir_entries(dir)->tables[page_dir_idx];
+    // Already mapped by a 4mb page
+    if(pde.present && pde.page_size)
+        return 1;
+    // If the coressponding page table does not exist, make one!
+    if(!pde.present)
+        table = new_page_table(dir, page_dir_idx);
+    else
+        table = table_of(dir, page_dir_idx);
+    if(!table)
+        return 0;
 
     // If the coressponding page does not exist, allocate_block!
     if(!table->pages[page_tbl_idx].present) {
@@ -110,12 +281,65 @@ void allocate_page(page_directory_t * dir, uint32_t virtual_addr, uint32_t frame
         // Normally, we'll allocate frames from physical memory manager, but sometimes it's useful to be able to set any frame(for example, share memory between process)
         if(frame)
             t = frame;
+        else if(virtual_addr < LOAD_MEMORY_ADDRESS)
+            // User pages must not show what was in the frame before
+            t = pmm_alloc_zeroed();
         else
             t = allocate_block();
+        if(t == (uint32_t)-1) {
+            qemu_printf("allocate_page: out of memory mapping 0x%p\n", virtual_addr);
+            return 0;
+        }
         table->pages[page_tbl_idx].frame = t;
         table->pages[page_tbl_idx].present = 1;
-        table->pages[page_tbl_idx].rw = 1;
+        table->pages[page_tbl_idx].rw = is_writable ? 1 : 0;
         table->pages[page_tbl_idx].user = 1;
+        uint32_t * rss = rss_of(dir);
+        if(virtual_addr < LOAD_MEMORY_ADDRESS && rss)
+            (*rss)++;
+        // Kernel mappings are the same in every address space, keep them in the tlb across cr3 reloads
+        table->pages[page_tbl_idx].global = (virtual_addr >= LOAD_MEMORY_ADDRESS);
+        // Global entries survive cr3 reloads, so never rely on one to drop a stale translation
+        asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+    }
+    return 1;
+}
+
+/*
+ * Map 4mb at virtual_addr with a single page directory entry, frame is the first of 1024 contiguous physical blocks
+ * Both virtual_addr and frame must be 4mb aligned
+ * */
+void allocate_large_page(page_directory_t * dir, uint32_t virtual_addr, uint32_t frame) {
+    uint32_t page_dir_idx = PAGEDIR_INDEX(virtual_addr);
+    ASSERT(LARGEPAGE_OFFSET(virtual_addr) == 0 && (frame & 0x3ff) == 0);
+    page_dir_entry_t * pde = &dir_entries(dir)->tables[page_dir_idx];
+    if(pde->present) {
+        qemu_printf("allocate_large_page: page dir entry already exists\n");
+        return;
+    }
+    pde->frame = frame;
+    pde->present = 1;
+    pde->rw = 1;
+    pde->user = 1;
+    pde->page_size = 1;
+    pde->global = (virtual_addr >= LOAD_MEMORY_ADDRESS);
+}
+
+/*
+ * Identity map a region of device memory(such as the framebuffer) with 4mb pages, the region is rounded out to 4mb boundaries
+ * Any 4mb that already has a page table is mapped with 4kb pages instead
+ * */
+void allocate_large_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va) {
+    uint32_t start = start_va & ~(LARGE_PAGE_SIZE - 1);
+    while(start <= end_va) {
+        if(!dir_entries(dir)->tables[PAGEDIR_INDEX(start)].present)
+            allocate_large_page(dir, start, start / PAGE_SIZE);
+        else
+            allocate_region(dir, max(start, start_va), min(start + LARGE_PAGE_SIZE - 1, end_va), 1, 1, 1);
+        // Don't wrap around at the top of the address space
+        if(start + LARGE_PAGE_SIZE < start)
+            break;
+        start = start + LARGE_PAGE_SIZE;
     }
 }
 
@@ -131,6 +355,23 @@ void free_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va, int
     }
 }
 
+/*
+ * Free the frames of [start_va, end_va) that are mapped, pages that were never touched(lazily mapped areas) are skipped quietly
+ * */
+void free_mapped_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va) {
+    for(uint32_t va = start_va & 0xfffff000; va < end_va; va += PAGE_SIZE) {
+        page_dir_entry_t pde = dir_entries(dir)->tables[PAGEDIR_INDEX(va)];
+        if(!pde.present || pde.page_size) {
+            // Skip to the next page table
+            va = (va & 0xffc00000) + LARGE_PAGE_SIZE - PAGE_SIZE;
+            if(va + PAGE_SIZE == 0) break;
+            continue;
+        }
+        if(table_of(dir, PAGEDIR_INDEX(va))->pages[PAGETBL_INDEX(va)].present)
+            free_page(dir, va, 1);
+    }
+}
+
 /*
  * Find the corresponding page table entry, and set frame to 0
  * Also, clear corresponding bit in pmm bitmap
@@ -139,13 +380,17 @@ void free_region(page_directory_t * dir, uint32_t start_va, uint32_t end_va, int
  *      1 : free the frame
  * */
 void free_page(page_directory_t * dir, uint32_t virtual_addr, int free) {
-    if(dir == TEMP_PAGE_DIRECTORY) return;
+    if((uint32_t)dir == (uint32_t)TEMP_PAGE_DIRECTORY - LOAD_MEMORY_ADDRESS) return;
     uint32_t page_dir_idx = PAGEDIR_INDEX(virtual_addr), page_tbl_idx = PAGETBL_INDEX(virtual_addr);
-    if(!dir->ref_tables[page_dir_idx]) {
+    page_dir_entry_t pde = dir_entries(dir)->tables[page_dir_idx];
+    // 4mb pages map long-lived regions(kernel, initial heap, framebuffer), they're never taken apart, so just leave them mapped
+    if(pde.present && pde.page_size)
+        return;
+    if(!pde.present) {
         qemu_printf("free_page: page dir entry does not exist\n");
         return;
     }
-    page_table_t * table = dir->ref_tables[page_dir_idx];
+    page_table_t * table = table_of(dir, page_dir_idx);
     if(!table->pages[page_tbl_idx].present) {
         qemu_printf("free_page: page table entry does not exist\n");
         return;
@@ -155,78 +400,166 @@ void free_page(page_directory_t * dir, uint32_t virtual_addr, int free) {
         free_block(table->pages[page_tbl_idx].frame);
     table->pages[page_tbl_idx].present = 0;
     table->pages[page_tbl_idx].frame = 0;
+    table->pages[page_tbl_idx].global = 0;
+    uint32_t * rss = rss_of(dir);
+    if(virtual_addr < LOAD_MEMORY_ADDRESS && rss)
+        (*rss)--;
+    // Don't let a stale tlb entry keep the freed frame reachable(a cr3 reload wouldn't drop it if it's global)
+    asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+}
+
+/*
+ * Free the page table behind a page directory entry(not the frames it maps), its frame goes to the page table cache
+ * Don't use it on kernel tables, every address space links those
+ * */
+void free_page_table(page_directory_t * dir, uint32_t page_dir_idx) {
+    page_dir_entry_t pde = dir_entries(dir)->tables[page_dir_idx];
+    if(!pde.present || pde.page_size)
+        return;
+    page_table_t * table = table_of(dir, page_dir_idx);
+    memset(table, 0, sizeof(page_table_t));
+    memset(&dir_entries(dir)->tables[page_dir_idx], 0, sizeof(page_dir_entry_t));
+    asm volatile("invlpg (%0)" :: "r"(table) : "memory");
+    free_table_frame(pde.frame);
+}
+
+/*
+ * Allocate an empty page directory, one frame like a page table(it comes from the page table cache if there's one there), NULL if memory ran out
+ * */
+page_directory_t * alloc_page_directory() {
+    int zeroed;
+    uint32_t frame = alloc_table_frame(&zeroed);
+    if(frame == (uint32_t)-1)
+        return NULL;
+    if(!zeroed)
+        paging_zero_frame(frame);
+    return (page_directory_t*)(frame << 12);
+}
+
+/*
+ * Tear down an address space, every user frame it maps is freed(shared ones just lose a reference), then its page tables and the directory itself
+ * It must not be the loaded one
+ * */
+void free_page_directory(page_directory_t * dir) {
+    for(uint32_t i = 0; i < PAGEDIR_INDEX(LOAD_MEMORY_ADDRESS); i++) {
+        page_dir_entry_t pde = dir_entries(dir)->tables[i], * k = &kpage_dir_virt->tables[i];
+        // Linked kernel tables(the identity mapped low memory) belong to everyone
+        if(!pde.present || pde.page_size || (k->present && k->frame == pde.frame))
+            continue;
+        free_mapped_region(dir, i << 22, (i << 22) + LARGE_PAGE_SIZE);
+        free_page_table(dir, i);
+    }
+    // The frame goes back zeroed, like a page table's
+    memset(dir_entries(dir), 0, sizeof(page_directory_t));
+    // Nobody else may use the window onto it anymore(other cpus find out through window_generation, see free_table_frame)
+    unmap_foreign((uint32_t)dir);
+    free_table_frame((uint32_t)dir >> 12);
 }
 
 /*
  * Remap memory used by the kernel, and enable paging, again
+ * use_large_pages: map the kernel's first 4mb and the initial heap with 4mb pages instead of 4kb ones
  * */
-void paging_init() {
+void paging_init(int use_large_pages) {
     /*
      * Right now, we have a temporary page directory sitting in the kernel's data section
      * I don't like that... Instead, build a new set of paging structures in the memory outside of kernel data/code, by calling our physical memory manager
      * */
 
-    // Place paging data after pmm bitmap
-    temp_mem = bitmap + bitmap_size;
+    // Place paging data after pmm bitmap(and the buddy tree that follows it)
+    temp_mem = mem_start;
 
     // Allocate a page directory and set it to all zeros(don't need to allocate explicitly because in pmm_init, we already set aside first 4mb for kernel)
-    kpage_dir = dumb_kmalloc(sizeof(page_directory_t), 1);
-    memset(kpage_dir, 0, sizeof(page_directory_t));
+    kpage_dir_virt = dumb_kmalloc(sizeof(page_directory_t), 1);
+    memset(kpage_dir_virt, 0, sizeof(page_directory_t));
+    kpage_dir = virtual2phys(TEMP_PAGE_DIRECTORY, kpage_dir_virt);
+    set_dir_entry(&kpage_dir_virt->tables[RECURSIVE_PDE], (uint32_t)kpage_dir >> 12, 0);
 
-    // Now, map 4mb begining from 0xC0000000 to 0xC0400000(should corresponding to first 1024 physical blocks, so MAKE SURE pmm bitmap is all clear at this point)
+    large_pages = use_large_pages;
     uint32_t i = LOAD_MEMORY_ADDRESS;
-    while(i < LOAD_MEMORY_ADDRESS + 4 * M) {
-        allocate_page(kpage_dir, i, 0, 1, 1);
-        i = i + PAGE_SIZE;
+    if(large_pages) {
+        // The first 4mb is one page, the buddy allocator hands out physical blocks 0 - 1023 as one order 10 block on an empty bitmap
+        uint32_t frame = pmm_alloc_pages(BUDDY_MAX_ORDER);
+        ASSERT(frame == 0);
+        allocate_large_page(kpage_dir, i, frame);
+        // And so is every 4mb of the initial heap
+        i = LOAD_MEMORY_ADDRESS + 4 * M;
+        while(i < LOAD_MEMORY_ADDRESS + 4 * M + KHEAP_INITIAL_SIZE) {
+            frame = pmm_alloc_pages(BUDDY_MAX_ORDER);
+            if(frame == (uint32_t)-1)
+                PANIC("paging_init: not enough memory for the kernel heap");
+            allocate_large_page(kpage_dir, i, frame);
+            i = i + LARGE_PAGE_SIZE;
+        }
     }
-    // Map some memory after 0xc0400000 as kernel heeap ? do it later.
-    i = LOAD_MEMORY_ADDRESS + 4 * M;
-    while(i < LOAD_MEMORY_ADDRESS + 4 * M + KHEAP_INITIAL_SIZE) {
-        allocate_page(kpage_dir, i, 0, 1, 1);
-        i = i + PAGE_SIZE;
+    else {
+        // Now, map 4mb begining from 0xC0000000 to 0xC0400000(should corresponding to first 1024 physical blocks, so MAKE SURE pmm bitmap is all clear at this point)
+        while(i < LOAD_MEMORY_ADDRESS + 4 * M) {
+            allocate_page(kpage_dir, i, 0, 1, 1);
+            i = i + PAGE_SIZE;
+        }
+        // Map some memory after 0xc0400000 as kernel heeap ? do it later.
+        i = LOAD_MEMORY_ADDRESS + 4 * M;
+        while(i < LOAD_MEMORY_ADDRESS + 4 * M + KHEAP_INITIAL_SIZE) {
+            allocate_page(kpage_dir, i, 0, 1, 1);
+            i = i + PAGE_SIZE;
+        }
     }
 
     // Register page fault handler, do it later
     register_interrupt_handler(14, page_fault_handler);
 
     // Load kernel directory
-    switch_page_directory(kpage_dir, 0);
+    switch_page_directory(kpage_dir);
 
-    // Enable Paging (remember to set cr4 to disable 4mb pages too)
+    // Enable Paging (remember to set cr4 to disable 4mb pages too, unless we're using them)
     enable_paging();
     // Identity map the first
     allocate_region(kpage_dir, 0x0, 0x10000, 1, 1, 1);
+
+    // Have some page tables ready for the first processes
+    while(table_cache_count < PAGE_TABLE_CACHE_PREFILL) {
+        uint32_t frame = allocate_block();
+        paging_zero_frame(frame);
+        table_cache[table_cache_count++] = frame;
+    }
 }
 
 /*
- * Switch page directory,
- * phys : Is the address given physical or virtual ?
+ * Switch page directory
  * */
-void switch_page_directory(page_directory_t * page_dir, uint32_t phys) {
-    uint32_t t;
-    if(!phys)
-        t = (uint32_t)virtual2phys(TEMP_PAGE_DIRECTORY, page_dir);
-    else
-        t = (uint32_t)page_dir;
-    asm volatile("mov %0, %%cr3" :: "r"(t));
+void switch_page_directory(page_directory_t * page_dir) {
+    asm volatile("mov %0, %%cr3" :: "r"(page_dir) : "memory");
+    // The tlb is empty now, whatever the new directory's window shows has to be flushed again before it's used
+    this_cpu()->window = 0;
 }
 
 
 /*
- * Enable paging, turn off PSE bit first as it was turned on by entry.asm when kernel was loading
- * Then enable PG Bit in cr0
+ * Enable paging, turn off PSE bit first as it was turned on by entry.asm when kernel was loading(leave it on if we map with 4mb pages)
+ * Then enable PG Bit in cr0, and PGE bit in cr4
  * */
 void enable_paging() {
     uint32_t cr0, cr4;
 
     asm volatile("mov %%cr4, %0" : "=r"(cr4));
-    CLEAR_PSEBIT(cr4);
+    if(large_pages)
+        SET_PSEBIT(cr4);
+    else
+        CLEAR_PSEBIT(cr4);
     asm volatile("mov %0, %%cr4" :: "r"(cr4));
 
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
     SET_PGBIT(cr0);
+    // Make the kernel respect read-only pages too, so kernel writes into copy-on-write pages fault as well
+    SET_WPBIT(cr0);
     asm volatile("mov %0, %%cr0" :: "r"(cr0));
 
+    // Kernel pages are marked global, context switches don't flush them
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    SET_PGEBIT(cr4);
+    asm volatile("mov %0, %%cr4" :: "r"(cr4));
+
     paging_enabled = 1;
 }
 
@@ -292,17 +625,23 @@ restart_sbrk:
         }
     }
     else if(size < 0){
-        // Free as many pages as possible, then update heap_end, heap_curr and return old_heap_curr
+        // Free every whole page above the new boundary, then update heap_end, heap_curr and return old_heap_curr
         new_boundary = (void*)((uint32_t)heap_curr - (uint32_t)abs(size));
         if(new_boundary < heap_start + HEAP_MIN_SIZE) {
             new_boundary = heap_start + HEAP_MIN_SIZE;
         }
-        runner = heap_end - PAGE_SIZE;
-        while(runner > new_boundary) {
+        void * keep = (void*)ALIGN((uint32_t)new_boundary, PAGE_SIZE);
+        // The other cpus may still have the pages in their tlbs and there's no shootdown ipi, so with more than one cpu they stay mapped
+        // (mapping a page needs no shootdown, a tlb never holds a not present entry)
+        if(num_cpus > 1)
+            keep = heap_end;
+        runner = keep;
+        while(runner < heap_end) {
             free_page(kpage_dir, (uint32_t)runner, 1);
-            runner = runner - PAGE_SIZE;
+            runner = runner + PAGE_SIZE;
         }
-        heap_end = runner + PAGE_SIZE;
+        if(keep < heap_end)
+            heap_end = keep;
         goto update_boundary;
     }
 update_boundary:
@@ -313,67 +652,208 @@ ret:
 
 /*
  * Copy a page directory
+ * Kernel tables are linked, so every address space sees the same kernel
+ * User tables are copied copy-on-write, the new address space gets its own page tables but no frames are copied(see copy_page_table)
+ * Returns 0 if memory ran out, dst is then only partly copied and has to be freed with free_page_directory()
  * */
-void copy_page_directory(page_directory_t * dst, page_directory_t * src) {
-    for(uint32_t i = 0; i < 1024; i++) {
-        if(kpage_dir->ref_tables[i] == src->ref_tables[i]) {
+int copy_page_directory(page_directory_t * dst, page_directory_t * src) {
+    int ok = 1;
+    for(uint32_t i = 0; i < FOREIGN_PDE && ok; i++) {
+        page_dir_entry_t * k = &kpage_dir_virt->tables[i];
+        page_dir_entry_t s = dir_entries(src)->tables[i];
+        if(!s.present || (k->present && k->frame == s.frame)) {
             // Link kernel pages
-            dst->tables[i] = src->tables[i];
-            dst->ref_tables[i] = src->ref_tables[i];
+            dir_entries(dst)->tables[i] = *k;
         }
         else {
-            // For non-kernel pages, copy the pages (for example, when forking process, you don't want the parent process mess with child process's memory)
-            dst->ref_tables[i] = copy_page_table(src, dst, i, src->ref_tables[i]);
-            uint32_t phys = (uint32_t)virtual2phys(src, dst->ref_tables[i]);
-            dst->tables[i].frame = phys >> 12;
-            dst->tables[i].user = 1;
-            dst->tables[i].rw = 1;
-            dst->tables[i].present = 1;
+            // For non-kernel pages, share the frames copy-on-write (for example, when forking process, you don't want the parent process mess with child process's memory)
+            ok = copy_page_table(src, dst, i);
         }
     }
+    // Each address space maps itself
+    page_directory_t * d = dir_entries(dst);
+    memset(&d->tables[FOREIGN_PDE], 0, sizeof(page_dir_entry_t));
+    set_dir_entry(&d->tables[RECURSIVE_PDE], (uint32_t)dst >> 12, 0);
+    // Writable pages in src may have just become read-only, flush the tlb
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" :: "r"(cr3));
+    return ok;
 }
+
 /*
- * Copy a page directory
+ * Point a page table entry at another frame, copying what's currently visible at virtual_addr into it
+ * The entry must belong to the loaded address space
  * */
-page_table_t * copy_page_table(page_directory_t * src_page_dir, page_directory_t * dst_page_dir, uint32_t page_dir_idx, page_table_t * src) {
-    page_table_t * table = (page_table_t*)kmalloc_a(sizeof(page_table_t));
+static void copy_into_frame(page_table_entry_t * pte, uint32_t virtual_addr, uint32_t frame) {
+    memcpy(cow_buffer, (void*)virtual_addr, PAGE_SIZE);
+    pte->frame = frame;
+    pte->rw = 1;
+    asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+    memcpy((void*)virtual_addr, cow_buffer, PAGE_SIZE);
+}
+
+/*
+ * Copy a page table
+ * The frames are not copied, both tables point to the same frames, which become read-only and marked PAGE_COW in both, the first write from either side gets a private copy(see page_fault_handler)
+ * src_page_dir must be the loaded address space, returns 0 if memory ran out
+ * */
+int copy_page_table(page_directory_t * src_page_dir, page_directory_t * dst_page_dir, uint32_t page_dir_idx) {
+    page_table_t * src = table_of(src_page_dir, page_dir_idx);
+    page_table_t * table = new_page_table(dst_page_dir, page_dir_idx);
+    if(!table)
+        return 0;
     for(int i = 0; i < 1024; i++) {
-        if(!table->pages[i].frame)
+        page_table_entry_t * pte = &src->pages[i];
+        if(!pte->present)
             continue;
-        // Source frame's virtual address
-        uint32_t src_virtual_address = (page_dir_idx << 22) | (i << 12) | (0);
-        // Destination frame's virtual address
-        uint32_t dst_virtual_address = src_virtual_address;
-        // Temporary virtual address in current virtual address space
-        uint32_t tmp_virtual_address = 0;
-
-        // Allocate a frame in destination page table
-        allocate_page(dst_page_dir, dst_virtual_address, 0, 0, 1);
-        // Now I want tmp_virtual_address and dst_virtual_address both points to the same frame
-        allocate_page(src_page_dir, tmp_virtual_address, (uint32_t)virtual2phys(dst_page_dir, (void*)dst_virtual_address), 0, 1);
-        if (src->pages[i].present) table->pages[i].present = 1;
-        if (src->pages[i].rw)      table->pages[i].rw = 1;
-        if (src->pages[i].user)    table->pages[i].user = 1;
-        if (src->pages[i].accessed)table->pages[i].accessed = 1;
-        if (src->pages[i].dirty)   table->pages[i].dirty = 1;
-        memcpy((void*)tmp_virtual_address, (void*)src_virtual_address, PAGE_SIZE);
-        // Unlink frame
-        free_page(src_page_dir, tmp_virtual_address, 0);
+        if(!pmm_frame_share(pte->frame)) {
+            // Too many address spaces share this frame already, copy it now
+            uint32_t virtual_addr = (page_dir_idx << 22) | (i << 12);
+            uint32_t frame = pte->frame, rw = pte->rw;
+            uint32_t copy = allocate_block();
+            if(copy == (uint32_t)-1)
+                return 0;
+            copy_into_frame(pte, virtual_addr, copy);
+            table->pages[i] = *pte;
+            pte->frame = frame;
+            pte->rw = rw;
+            asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+            continue;
+        }
+        if(pte->rw) {
+            pte->rw = 0;
+            pte->available |= PAGE_COW;
+        }
+        table->pages[i] = *pte;
     }
-    return table;
+    return 1;
+}
+
+/*
+ * The page directory that's loaded, the current process's one if it's running, the kernel's otherwise
+ * */
+static page_directory_t * loaded_page_directory() {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    if(current_process && current_process->page_dir && (uint32_t)current_process->page_dir == cr3)
+        return current_process->page_dir;
+    return kpage_dir;
+}
+
+/*
+ * Resolve a write fault on a copy-on-write page, return 0 if the fault wasn't caused by copy on write
+ * If nobody else uses the frame anymore just make it writable again, otherwise give this address space its own copy
+ * */
+static int handle_cow_fault(uint32_t faulting_addr) {
+    page_dir_entry_t * pde = &PAGE_DIRECTORY->tables[PAGEDIR_INDEX(faulting_addr)];
+    if(!pde->present || pde->page_size) return 0;
+    page_table_entry_t * pte = &PAGE_TABLES[PAGEDIR_INDEX(faulting_addr)].pages[PAGETBL_INDEX(faulting_addr)];
+    if(!pte->present || !(pte->available & PAGE_COW)) return 0;
+
+    uint32_t virtual_addr = faulting_addr & 0xfffff000;
+    pte->available &= ~PAGE_COW;
+    if(pmm_frame_refs(pte->frame) == 1) {
+        pte->rw = 1;
+        asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+        return 1;
+    }
+    uint32_t copy = allocate_block();
+    if(copy == (uint32_t)-1) {
+        // Out of memory, the page stays shared and the fault goes unhandled
+        pte->available |= PAGE_COW;
+        return 0;
+    }
+    uint32_t old_frame = pte->frame;
+    copy_into_frame(pte, virtual_addr, copy);
+    // Drop our reference to the shared frame
+    free_block(old_frame);
+    return 1;
+}
+
+/*
+ * Map a page of a file mapping, the frame comes from the page cache(it's read into the cache first if needed)
+ * The page is shared with the cache, so it's read-only, writable areas get a private copy on the first write
+ * Returns 0 if memory ran out
+ * */
+static int map_file_page(page_directory_t * dir, vm_area_t * vma, uint32_t virtual_addr) {
+    uint32_t page_idx = (vma->file_offset + (virtual_addr - vma->start)) / PAGE_SIZE;
+    uint32_t frame = page_cache_find(vma->file, page_idx);
+    if(frame && !pmm_frame_share(frame)) {
+        // Mapped too many times already, this one gets a private copy
+        if(!allocate_page(dir, virtual_addr, 0, 0, 1))
+            return 0;
+        vfs_readpage(vma->file, page_idx, (char*)virtual_addr);
+        return 1;
+    }
+    if(!frame) {
+        frame = allocate_block();
+        if(frame == (uint32_t)-1)
+            return 0;
+        if(!allocate_page(dir, virtual_addr, frame, 0, 1)) {
+            free_block(frame);
+            return 0;
+        }
+        vfs_readpage(vma->file, page_idx, (char*)virtual_addr);
+        page_cache_insert(vma->file, page_idx, frame);
+        // One reference for the cache, one for this mapping
+        pmm_frame_share(frame);
+    }
+    else if(!allocate_page(dir, virtual_addr, frame, 0, 1)) {
+        // Give back the reference taken for this mapping
+        free_block(frame);
+        return 0;
+    }
+    page_table_entry_t * pte = &PAGE_TABLES[PAGEDIR_INDEX(virtual_addr)].pages[PAGETBL_INDEX(virtual_addr)];
+    pte->rw = 0;
+    if(vma->flags & VMA_WRITE)
+        pte->available |= PAGE_COW;
+    asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+    return 1;
+}
+
+/*
+ * Resolve a fault on a page that's part of one of the current process's lazily mapped areas, return 0 if the address isn't in any of them
+ * Map a frame and read the page's content from the executable(or from the page cache, for file mappings)
+ * */
+static int handle_demand_fault(uint32_t faulting_addr) {
+    page_directory_t * dir = loaded_page_directory();
+    if(!current_process || dir != current_process->page_dir)
+        return 0;
+    vm_area_t * vma = vma_find(current_process->vmas, faulting_addr);
+    if(!vma)
+        return 0;
+    uint32_t virtual_addr = faulting_addr & 0xfffff000;
+    if(vma->flags & VMA_PAGECACHE)
+        return map_file_page(dir, vma, virtual_addr);
+    if(!allocate_page(dir, virtual_addr, 0, 0, 1))
+        return 0;
+    vma_fill_page(current_process->vmas, virtual_addr);
+    // Filled through a writable mapping(cr0.WP holds the kernel to the rw bit too), now give the page the area's permission
+    if(!(vma->flags & VMA_WRITE)) {
+        PAGE_TABLES[PAGEDIR_INDEX(virtual_addr)].pages[PAGETBL_INDEX(virtual_addr)].rw = 0;
+        asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+    }
+    return 1;
 }
 
 
 /* Print out useful information when a page fault occur
  * */
 void page_fault_handler(register_t * reg) {
-    asm volatile("sti");
+    uint32_t faulting_addr;
+    asm volatile("mov %%cr2, %0" : "=r" (faulting_addr));
+    // Write to a page shared copy-on-write ?
+    if((reg->err_code & ERR_PRESENT) && (reg->err_code & ERR_RW) && handle_cow_fault(faulting_addr))
+        return;
+    // Page that hasn't been loaded yet ?
+    if(!(reg->err_code & ERR_PRESENT) && handle_demand_fault(faulting_addr))
+        return;
+
     set_curr_color(LIGHT_RED);
-    qemu_printf("Page fault:\n");
+    qemu_printf("Page fault at 0x%p:\n", faulting_addr);
 
     // Gather fault info and print to screen
-    uint32_t faulting_addr;
-    asm volatile("mov %%cr2, %0" : "=r" (faulting_addr));
     uint32_t present = reg->err_code & ERR_PRESENT;
     uint32_t rw = reg->err_code & ERR_RW;
     uint32_t user = reg->err_code & ERR_USER;
@@ -389,7 +869,56 @@ void page_fault_handler(register_t * reg) {
     qemu_printf("]\n");
 
     print_reg(reg);
+    PANIC("Unhandled page fault");
 }
 
+/*
+ * Switch between two address spaces back and forth, touching some kernel heap pages after every switch, return average cycles per switch
+ * */
+static uint32_t time_cr3_switches(uint32_t cr3_a, uint32_t cr3_b) {
+    volatile uint8_t * pages = (uint8_t*)KHEAP_START;
+    uint32_t total = 0;
+    uint64_t t;
+    for(uint32_t b = 0; b < PAGING_BENCHMARK_SWITCHES / PAGING_BENCHMARK_BATCH; b++) {
+        t = rdtsc();
+        for(uint32_t i = 0; i < PAGING_BENCHMARK_BATCH; i++) {
+            asm volatile("mov %0, %%cr3" :: "r"((i & 1) ? cr3_a : cr3_b) : "memory");
+            for(uint32_t j = 0; j < PAGING_BENCHMARK_PAGES; j++)
+                (void)pages[j * PAGE_SIZE];
+        }
+        total += (uint32_t)(rdtsc() - t) / PAGING_BENCHMARK_BATCH;
+    }
+    return total / (PAGING_BENCHMARK_SWITCHES / PAGING_BENCHMARK_BATCH);
+}
 
+/*
+ * Measure what a context switch costs with and without global kernel pages
+ * */
+void paging_benchmark() {
+    uint32_t cr3, cr4, flushed, global;
+    page_directory_t * dir = alloc_page_directory();
+    if(!dir) {
+        qemu_printf("paging benchmark: out of memory\n");
+        return;
+    }
+    copy_page_directory(dir, kpage_dir);
+    uint32_t other = (uint32_t)dir;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+    // Without PGE, every cr3 reload drops the kernel's translations too
+    CLEAR_PGEBIT(cr4);
+    asm volatile("mov %0, %%cr4" :: "r"(cr4));
+    flushed = time_cr3_switches(cr3, other);
 
+    SET_PGEBIT(cr4);
+    asm volatile("mov %0, %%cr4" :: "r"(cr4));
+    global = time_cr3_switches(cr3, other);
+
+    asm volatile("mov %0, %%cr3" :: "r"(cr3));
+    // It only links the kernel's tables, so this just gives the directory back
+    free_page_directory(dir);
+    qemu_printf("paging benchmark(%u cr3 switches, %u kernel pages touched after each):\n", PAGING_BENCHMARK_SWITCHES, PAGING_BENCHMARK_PAGES);
+    qemu_printf("  without global pages: %u cycles per switch\n", flushed);
+    qemu_printf("  with global pages:    %u cycles per switch\n", global);
+}
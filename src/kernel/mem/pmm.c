@@ -2,33 +2,83 @@
 #include <system.h>
 #include <string.h>
 #include <serial.h>
+#include <math.h>
+#include <paging.h>
+#include <timer.h>
 
 uint8_t * bitmap = (uint8_t*)(&end);
 uint8_t * mem_start;
 uint32_t total_blocks;
 uint32_t bitmap_size;
 
+/*
+ * Buddy tree, sits right after the bitmap.
+ * It's a complete binary tree stored in an array(node 1 is the root, node n has children 2n and 2n+1), its leaves are the 32-bit words of the bitmap.
+ * Every node stores (order of the largest free, naturally aligned block in its subtree) + 1, or 0 if nothing is free under it.
+ * The bitmap stays the single source of truth, the tree is just an index over it, so allocate_block()/free_block() and the buddy api never disagree
+ * */
+uint8_t * buddy_tree;
+uint32_t buddy_leaves;
+uint32_t buddy_root_order;
+uint32_t bitmap_words;
+
+/*
+ * Reference counts for frames shared by several address spaces(copy on write after fork), one byte per frame, placed after the buddy tree
+ * frame_refs[i] is the number of users besides the first one, so a frame nobody shares has 0 and free_block() only really frees a frame when it's 0
+ * */
+uint8_t * frame_refs;
+
+// Frames handed out by the buddy allocator and not freed yet
+uint32_t used_blocks;
+
+// Frames that are already zeroed, handed out by pmm_alloc_zeroed()
+static uint32_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t zero_pool_count;
+
+static void buddy_update(uint32_t first_word, uint32_t count);
+
 /*
  * Physical memory manager initialization, memset the memory bitmap to all 0
  * */
 void pmm_init(uint32_t mem_size) {
     total_blocks = mem_size / BLOCK_SIZE;
     // For the given memory size, how many bytes is needed for the bitmap? (mem_size nees to be multiple of BLOCK_SIZE = 4096)
-    // #define BLOCKS_PER_BUCKET 8
-    bitmap_size = total_blocks / BLOCKS_PER_BUCKET;
-    if(bitmap_size * BLOCKS_PER_BUCKET < total_blocks)
-        bitmap_size++;
+    // The buddy tree reads the bitmap one 32-bit word at a time, so round it up to whole words
+    bitmap_words = total_blocks / 32;
+    if(bitmap_words * 32 < total_blocks)
+        bitmap_words++;
+    bitmap_size = bitmap_words * sizeof(uint32_t);
 
     // Clear bitmap
     memset(bitmap, 0, bitmap_size);
+    // Frames past the end of memory in the last word are never free
+    if(total_blocks % 32)
+        ((uint32_t*)bitmap)[bitmap_words - 1] = ~((1 << (total_blocks % 32)) - 1);
+
+    // Build the buddy tree over the bitmap words
+    buddy_leaves = 1;
+    buddy_root_order = BUDDY_LEAF_ORDER;
+    while(buddy_leaves < bitmap_words) {
+        buddy_leaves = buddy_leaves << 1;
+        buddy_root_order++;
+    }
+    buddy_tree = bitmap + bitmap_size;
+    memset(buddy_tree, 0, 2 * buddy_leaves);
+    used_blocks = 0;
+
+    buddy_update(0, bitmap_words);
+
+    frame_refs = buddy_tree + 2 * buddy_leaves;
+    memset(frame_refs, 0, total_blocks);
 
     // Start of all blcoks
-    mem_start = (uint8_t*)BLOCK_ALIGN(((uint32_t)(bitmap + bitmap_size)));
+    mem_start = (uint8_t*)BLOCK_ALIGN(((uint32_t)(frame_refs + total_blocks)));
 #if 0
     qemu_printf("mem size:     %u mb\n", mem_size / (1024 * 1024));
     qemu_printf("total_blocks: %u\n", total_blocks);
     qemu_printf("bitmap addr:  0x%p\n", bitmap);
     qemu_printf("bitmap_size:  %u\n", bitmap_size);
+    qemu_printf("buddy tree:   0x%p (%u leaves)\n", buddy_tree, buddy_leaves);
     qemu_printf("mem_start:    0x%p\n", mem_start);
 
     for(int i = 0; i < bitmap_size; i++) {
@@ -44,28 +94,303 @@ void pmm_init(uint32_t mem_size) {
  * */
 
 uint32_t allocate_block() {
-    uint32_t free_block = first_free_block();
-    SETBIT(free_block);
-    return free_block;
+    return pmm_alloc_pages(0);
 }
 
 void free_block(uint32_t blk_num) {
-    CLEARBIT(blk_num);
+    if(blk_num >= total_blocks) {
+        qemu_printf("pmm: freeing invalid block %u\n", blk_num);
+        return;
+    }
+    // Someone else still uses this frame
+    if(frame_refs[blk_num]) {
+        frame_refs[blk_num]--;
+        return;
+    }
+    pmm_free_pages(blk_num, 0);
+}
+
+/*
+ * Allocate a frame that's filled with zeros, from the pool if there's one ready, otherwise zero it now
+ * Needs paging to be enabled
+ * */
+uint32_t pmm_alloc_zeroed() {
+    if(zero_pool_count)
+        return zero_pool[--zero_pool_count];
+    uint32_t blk = allocate_block();
+    // Out of memory, there's no frame to zero
+    if(blk == (uint32_t)-1)
+        return blk;
+    paging_zero_frame(blk);
+    return blk;
+}
+
+/*
+ * Zero at most max frames into the pool, returns how many were added
+ * */
+uint32_t pmm_zero_pool_refill(uint32_t max) {
+    uint32_t added = 0;
+    while(max-- && zero_pool_count < PMM_ZERO_POOL_SIZE) {
+        uint32_t blk = allocate_block();
+        if(blk == (uint32_t)-1) break;
+        paging_zero_frame(blk);
+        zero_pool[zero_pool_count++] = blk;
+        added++;
+    }
+    return added;
 }
 
 /*
- * Helper function for allocate_block(), return the first free block
+ * One more address space uses this frame, returns 0 if the count is saturated(then the caller has to make a private copy instead)
+ * */
+uint32_t pmm_frame_share(uint32_t blk_num) {
+    if(frame_refs[blk_num] == FRAME_MAX_SHARE)
+        return 0;
+    frame_refs[blk_num]++;
+    return 1;
+}
+
+/*
+ * How many address spaces use this frame
+ * */
+uint32_t pmm_frame_refs(uint32_t blk_num) {
+    return frame_refs[blk_num] + 1;
+}
+
+/*
+ * For a bitmap word, compute where the free, naturally aligned blocks of every order(0 to 5) start
+ * free[k] has bit p set if frames [p, p + 2^k) of this word are all free
+ * */
+static void word_free_masks(uint32_t word, uint32_t * free) {
+    free[0] = ~word;
+    free[1] = free[0] & (free[0] >> 1) & 0x55555555;
+    free[2] = free[1] & (free[1] >> 2) & 0x11111111;
+    free[3] = free[2] & (free[2] >> 4) & 0x01010101;
+    free[4] = free[3] & (free[3] >> 8) & 0x00010001;
+    free[5] = free[4] & (free[4] >> 16) & 0x1;
+}
+
+/*
+ * Value of a leaf in the buddy tree, (largest free order in the word) + 1
+ * */
+static uint8_t buddy_leaf_value(uint32_t word) {
+    uint32_t free[BUDDY_LEAF_ORDER + 1];
+    word_free_masks(word, free);
+    for(int k = BUDDY_LEAF_ORDER; k >= 0; k--) {
+        if(free[k])
+            return k + 1;
+    }
+    return 0;
+}
+
+/*
+ * Recompute the leaves for bitmap words [first_word, first_word + count), then walk up and fix every ancestor
+ * This is also where buddies get coalesced: a parent whose two halves are completely free becomes one free block of the next order
+ * */
+static void buddy_update(uint32_t first_word, uint32_t count) {
+    uint32_t * words = (uint32_t*)bitmap;
+    uint32_t lo = buddy_leaves + first_word, hi = lo + count - 1;
+    uint32_t order = BUDDY_LEAF_ORDER;
+    for(uint32_t n = lo; n <= hi; n++) {
+        uint32_t w = n - buddy_leaves;
+        if(w >= bitmap_words) {
+            buddy_tree[n] = 0;
+            continue;
+        }
+        buddy_tree[n] = buddy_leaf_value(words[w]);
+    }
+    while(lo > 1) {
+        lo = lo >> 1;
+        hi = hi >> 1;
+        order++;
+        for(uint32_t n = lo; n <= hi; n++) {
+            uint8_t l = buddy_tree[2 * n], r = buddy_tree[2 * n + 1];
+            if(l == order && r == order)
+                buddy_tree[n] = order + 1;
+            else
+                buddy_tree[n] = max(l, r);
+        }
+    }
+}
+
+/*
+ * Inside a single bitmap word, pick where a block of 2^order frames should go
+ * Just like a buddy system splits the smallest free block that fits, prefer a free block whose buddy is in use, so larger blocks stay intact
+ * */
+static uint32_t buddy_word_slot(uint32_t word, uint32_t order) {
+    uint32_t free[BUDDY_LEAF_ORDER + 1];
+    word_free_masks(word, free);
+    for(uint32_t k = order; k < BUDDY_LEAF_ORDER; k++) {
+        uint32_t parent = free[k + 1] | (free[k + 1] << (1 << k));
+        uint32_t maximal = free[k] & ~parent;
+        if(maximal)
+            return __builtin_ctz(maximal);
+    }
+    // The whole word is free
+    return 0;
+}
+
+/*
+ * Allocate 2^order physically contiguous frames, aligned to their size, return the first block number
+ * Cost is one walk down the buddy tree plus one walk up, O(log n) no matter how full memory is
+ * */
+uint32_t pmm_alloc_pages(uint32_t order) {
+    uint32_t * words = (uint32_t*)bitmap;
+    if(order > BUDDY_MAX_ORDER || buddy_tree[1] < order + 1) {
+        qemu_printf("pmm: Running out of free blocks!\n");
+        return (uint32_t) -1;
+    }
+    // Walk down, always take the lowest addressed half that can hold the request
+    // (paging_init relies on this: on an empty bitmap, frames come out as 0, 1, 2...)
+    uint32_t n = 1, span = buddy_root_order;
+    uint32_t stop = max(order, BUDDY_LEAF_ORDER);
+    while(span > stop) {
+        if(buddy_tree[2 * n] > order)
+            n = 2 * n;
+        else
+            n = 2 * n + 1;
+        span--;
+    }
+
+    if(order >= BUDDY_LEAF_ORDER) {
+        // n is a completely free block that spans whole bitmap words
+        uint32_t count = 1 << (order - BUDDY_LEAF_ORDER);
+        uint32_t first = (n << (order - BUDDY_LEAF_ORDER)) - buddy_leaves;
+        memset(&words[first], 0xff, count * sizeof(uint32_t));
+        buddy_update(first, count);
+        used_blocks += 1 << order;
+        return first * 32;
+    }
+
+    // n is a leaf, find the frames inside its word
+    uint32_t w = n - buddy_leaves;
+    uint32_t slot = buddy_word_slot(words[w], order);
+    words[w] = words[w] | (((1 << (1 << order)) - 1) << slot);
+    buddy_update(w, 1);
+    used_blocks += 1 << order;
+    return w * 32 + slot;
+}
+
+/*
+ * Give 2^order frames starting at blk_num back, the buddy tree merges them with their free buddies
+ * */
+void pmm_free_pages(uint32_t blk_num, uint32_t order) {
+    uint32_t * words = (uint32_t*)bitmap;
+    if(blk_num >= total_blocks || blk_num + (1 << order) > total_blocks) {
+        qemu_printf("pmm: freeing invalid block %u\n", blk_num);
+        return;
+    }
+    if(blk_num & ((1 << order) - 1)) {
+        qemu_printf("pmm: freeing misaligned block %u(order %u)\n", blk_num, order);
+        return;
+    }
+    if(order >= BUDDY_LEAF_ORDER) {
+        uint32_t count = 1 << (order - BUDDY_LEAF_ORDER);
+        for(uint32_t i = 0; i < count; i++) {
+            if(words[blk_num / 32 + i] != 0xFFFFFFFF) {
+                qemu_printf("pmm: freeing block %u(order %u) which is not allocated\n", blk_num, order);
+                return;
+            }
+        }
+        used_blocks -= 1 << order;
+        memset(&words[blk_num / 32], 0, count * sizeof(uint32_t));
+        buddy_update(blk_num / 32, count);
+        return;
+    }
+    uint32_t mask = ((1 << (1 << order)) - 1) << (blk_num % 32);
+    if((words[blk_num / 32] & mask) != mask) {
+        qemu_printf("pmm: freeing block %u(order %u) which is not allocated\n", blk_num, order);
+        return;
+    }
+    used_blocks -= 1 << order;
+    words[blk_num / 32] = words[blk_num / 32] & ~mask;
+    buddy_update(blk_num / 32, 1);
+}
+
+/*
+ * System wide frame gauge
+ * */
+uint32_t pmm_used_blocks() {
+    return used_blocks;
+}
+
+uint32_t pmm_free_blocks() {
+    return total_blocks - used_blocks;
+}
+
+void pmm_print_stats() {
+    qemu_printf("pmm: %u of %u frames in use, %u kb free\n", used_blocks, total_blocks, pmm_free_blocks() * (BLOCK_SIZE / 1024));
+}
+
+/*
+ * Return the first free block, without allocating it
+ * A node of the buddy tree is non zero iff something under it is free, so walk down to the leftmost such leaf, then bsf on its bitmap word gives the frame
  * */
 uint32_t first_free_block() {
+    if(!buddy_tree[1]) {
+        qemu_printf("pmm: Running out of free blocks!\n");
+        return (uint32_t) -1;
+    }
+    uint32_t n = 1;
+    while(n < buddy_leaves)
+        n = buddy_tree[2 * n] ? 2 * n : 2 * n + 1;
+    uint32_t w = n - buddy_leaves;
+    return w * 32 + __builtin_ctz(~GET_BUCKET32(w * 32));
+}
+
+/*
+ * The old way of finding a free block, one bit at a time from block 0, only kept around so pmm_benchmark() has something to compare with
+ * */
+static uint32_t first_free_block_bitwise() {
     uint32_t i;
     for(i = 0; i < total_blocks; i++) {
         if(!ISSET(i))
             return i;
     }
-    qemu_printf("pmm: Running out of free blocks!\n");
     return (uint32_t) -1;
 }
 
+/*
+ * Time 100k allocate/free pairs with the old bit-at-a-time scan, the buddy tree scan and the buddy allocator, print average cycles per pair
+ * Run it after paging and heap init so the bitmap looks like it does on a running system
+ * */
+#define PMM_BENCHMARK_PAIRS 100000
+#define PMM_BENCHMARK_BATCH 1000
+void pmm_benchmark() {
+    uint32_t bitwise = 0, treescan = 0, buddy = 0;
+    uint32_t blk;
+    uint64_t t;
+    // Time in batches and keep per-pair averages, so everything stays 32 bit(no 64 bit division in the kernel)
+    for(uint32_t b = 0; b < PMM_BENCHMARK_PAIRS / PMM_BENCHMARK_BATCH; b++) {
+        t = rdtsc();
+        for(uint32_t i = 0; i < PMM_BENCHMARK_BATCH; i++) {
+            blk = first_free_block_bitwise();
+            SETBIT(blk);
+            CLEARBIT(blk);
+        }
+        bitwise += (uint32_t)(rdtsc() - t) / PMM_BENCHMARK_BATCH;
+
+        t = rdtsc();
+        for(uint32_t i = 0; i < PMM_BENCHMARK_BATCH; i++) {
+            blk = first_free_block();
+            SETBIT(blk);
+            CLEARBIT(blk);
+        }
+        treescan += (uint32_t)(rdtsc() - t) / PMM_BENCHMARK_BATCH;
+
+        t = rdtsc();
+        for(uint32_t i = 0; i < PMM_BENCHMARK_BATCH; i++) {
+            blk = allocate_block();
+            free_block(blk);
+        }
+        buddy += (uint32_t)(rdtsc() - t) / PMM_BENCHMARK_BATCH;
+    }
+    qemu_printf("pmm benchmark(%u allocate/free pairs, first free block is %u):\n", PMM_BENCHMARK_PAIRS, first_free_block());
+    qemu_printf("  bit-at-a-time scan: %u cycles per pair\n", bitwise / (PMM_BENCHMARK_PAIRS / PMM_BENCHMARK_BATCH));
+    qemu_printf("  buddy tree scan:    %u cycles per pair\n", treescan / (PMM_BENCHMARK_PAIRS / PMM_BENCHMARK_BATCH));
+    qemu_printf("  buddy allocator:    %u cycles per pair\n", buddy / (PMM_BENCHMARK_PAIRS / PMM_BENCHMARK_BATCH));
+}
+
 void simple_test() {
 
     qemu_printf("\n");
@@ -0,0 +1,169 @@
+#include <slab.h>
+#include <kheap.h>
+#include <string.h>
+#include <serial.h>
+
+/*
+ * Object caches for the handful of fixed sizes the kernel allocates all the time(inode_t, pcb_t, listnode_t...)
+ * Slabs come from kmalloc, but once a slab exists, allocating and freeing an object is just a few pointer operations, it never walks the heap's free list
+ * */
+
+// All caches ever created, so they can be dumped together
+kmem_cache_t * cache_chain = NULL;
+
+/*
+ * Which list should a slab be on, given how many of its objects are in use
+ * */
+static kmem_slab_t ** slab_list_for(kmem_cache_t * cache, kmem_slab_t * slab) {
+    if(slab->in_use == 0)
+        return &cache->empty;
+    if(slab->in_use == cache->objects_per_slab)
+        return &cache->full;
+    return &cache->partial;
+}
+
+static void slab_list_remove(kmem_slab_t ** list, kmem_slab_t * slab) {
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if(slab->next)
+        slab->next->prev = slab->prev;
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+static void slab_list_push(kmem_slab_t ** list, kmem_slab_t * slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/*
+ * Get a new slab from the heap, and chain all its objects into the slab's free list
+ * */
+static kmem_slab_t * slab_grow(kmem_cache_t * cache) {
+    kmem_slab_t * slab = kmalloc(sizeof(kmem_slab_t) + cache->objects_per_slab * cache->slot_size);
+    if(!slab)
+        return NULL;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_objects = NULL;
+    void * slot = (void*)(slab + 1);
+    for(uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        void * obj = slot + sizeof(kmem_slab_t*);
+        *((kmem_slab_t**)slot) = slab;
+        *((void**)obj) = slab->free_objects;
+        slab->free_objects = obj;
+        slot = slot + cache->slot_size;
+    }
+    slab_list_push(&cache->empty, slab);
+    cache->num_slabs++;
+    cache->total_objects += cache->objects_per_slab;
+    return slab;
+}
+
+/*
+ * Create a named object cache for objects of a given size
+ * */
+kmem_cache_t * kmem_cache_create(char * name, uint32_t size) {
+    kmem_cache_t * cache = kcalloc(sizeof(kmem_cache_t), 1);
+    strncpy(cache->name, name, KMEM_CACHE_NAME_LEN - 1);
+    cache->object_size = size;
+    // A free object must be able to hold the free list pointer
+    if(size < sizeof(void*))
+        size = sizeof(void*);
+    cache->slot_size = ALIGN(size + sizeof(kmem_slab_t*), sizeof(void*));
+    cache->objects_per_slab = (PAGE_SIZE - sizeof(kmem_slab_t)) / cache->slot_size;
+    if(cache->objects_per_slab < SLAB_MIN_OBJECTS)
+        cache->objects_per_slab = SLAB_MIN_OBJECTS;
+    cache->next = cache_chain;
+    cache_chain = cache;
+    return cache;
+}
+
+/*
+ * Take one object from the cache, prefer partially used slabs so empty ones can be given back
+ * */
+void * kmem_cache_alloc(kmem_cache_t * cache) {
+    kmem_slab_t * slab = cache->partial;
+    if(!slab)
+        slab = cache->empty;
+    if(!slab)
+        slab = slab_grow(cache);
+    if(!slab) {
+        qemu_printf("kmem_cache_alloc: cache %s is out of memory\n", cache->name);
+        return NULL;
+    }
+    kmem_slab_t ** old_list = slab_list_for(cache, slab);
+    void * obj = slab->free_objects;
+    slab->free_objects = *((void**)obj);
+    slab->in_use++;
+    kmem_slab_t ** new_list = slab_list_for(cache, slab);
+    if(old_list != new_list) {
+        slab_list_remove(old_list, slab);
+        slab_list_push(new_list, slab);
+    }
+    cache->active_objects++;
+    cache->allocs++;
+    return obj;
+}
+
+/*
+ * Same as kmem_cache_alloc, but zero the object
+ * */
+void * kmem_cache_zalloc(kmem_cache_t * cache) {
+    void * obj = kmem_cache_alloc(cache);
+    if(obj)
+        memset(obj, 0, cache->object_size);
+    return obj;
+}
+
+/*
+ * Put an object back into its slab
+ * We keep at most one empty slab around per cache, the rest goes back to the heap
+ * */
+void kmem_cache_free(kmem_cache_t * cache, void * obj) {
+    if(!obj) return;
+    kmem_slab_t * slab = *((kmem_slab_t**)(obj - sizeof(kmem_slab_t*)));
+    if(slab->cache != cache) {
+        qemu_printf("kmem_cache_free: 0x%p does not belong to cache %s\n", obj, cache->name);
+        return;
+    }
+    kmem_slab_t ** old_list = slab_list_for(cache, slab);
+    *((void**)obj) = slab->free_objects;
+    slab->free_objects = obj;
+    slab->in_use--;
+    cache->active_objects--;
+    cache->frees++;
+    kmem_slab_t ** new_list = slab_list_for(cache, slab);
+    if(old_list == new_list)
+        return;
+    slab_list_remove(old_list, slab);
+    if(new_list == &cache->empty && cache->empty) {
+        cache->num_slabs--;
+        cache->total_objects -= cache->objects_per_slab;
+        kfree(slab);
+        return;
+    }
+    slab_list_push(new_list, slab);
+}
+
+/*
+ * Print usage of one cache
+ * */
+void kmem_cache_print_stats(kmem_cache_t * cache) {
+    qemu_printf("%s: object size %u, %u/%u objects active in %u slabs, %u allocs, %u frees\n", cache->name, cache->object_size,
+            cache->active_objects, cache->total_objects, cache->num_slabs, cache->allocs, cache->frees);
+}
+
+/*
+ * Print usage of every cache
+ * */
+void kmem_cache_print_all() {
+    qemu_printf("slab caches:\n");
+    for(kmem_cache_t * cache = cache_chain; cache; cache = cache->next)
+        kmem_cache_print_stats(cache);
+}
@@ -0,0 +1,186 @@
+#include <vma.h>
+#include <slab.h>
+#include <string.h>
+#include <paging.h>
+#include <math.h>
+
+/*
+ * Per process lists of virtual memory areas, used to load executables lazily(demand paging)
+ * */
+
+kmem_cache_t * vma_cache;
+
+static vm_area_t * vma_alloc() {
+    if(!vma_cache)
+        vma_cache = kmem_cache_create("vm_area_t", sizeof(vm_area_t));
+    return kmem_cache_zalloc(vma_cache);
+}
+
+/*
+ * Add an area covering the pages of [start, end) to the list
+ * The first file_size bytes from start are read from file at file_offset, the rest is zero filled, pass a NULL file for an all zero area
+ * */
+vm_area_t * vma_add(vm_area_t ** list, uint32_t start, uint32_t end, uint32_t flags, vfs_node_t * file, uint32_t file_offset, uint32_t file_size) {
+    vm_area_t * vma = vma_alloc();
+    vma->start = start & 0xfffff000;
+    vma->end = ALIGN(end, PAGE_SIZE);
+    vma->flags = flags;
+    vma->file = file;
+    vma->file_offset = file_offset;
+    vma->data_start = start;
+    vma->data_end = file ? start + file_size : start;
+    vma->next = *list;
+    *list = vma;
+    return vma;
+}
+
+/*
+ * Find the area containing addr
+ * */
+vm_area_t * vma_find(vm_area_t * list, uint32_t addr) {
+    for(vm_area_t * vma = list; vma; vma = vma->next) {
+        if(addr >= vma->start && addr < vma->end)
+            return vma;
+    }
+    return NULL;
+}
+
+/*
+ * Find the first area with all of flags set
+ * */
+vm_area_t * vma_find_flags(vm_area_t * list, uint32_t flags) {
+    for(vm_area_t * vma = list; vma; vma = vma->next) {
+        if((vma->flags & flags) == flags)
+            return vma;
+    }
+    return NULL;
+}
+
+/*
+ * Does any area overlap [start, end) ?
+ * */
+int vma_overlaps(vm_area_t * list, uint32_t start, uint32_t end) {
+    for(vm_area_t * vma = list; vma; vma = vma->next) {
+        if(start < vma->end && vma->start < end)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Find the highest free range of size bytes(page aligned) within [bottom, top), return 0 if there's none
+ * */
+uint32_t vma_find_gap(vm_area_t * list, uint32_t size, uint32_t bottom, uint32_t top) {
+    size = ALIGN(size, PAGE_SIZE);
+    if(!size || size > top - bottom)
+        return 0;
+    uint32_t start = (top - size) & 0xfffff000;
+    while(start >= bottom) {
+        vm_area_t * hit = NULL;
+        for(vm_area_t * vma = list; vma; vma = vma->next) {
+            if(start < vma->end && vma->start < start + size) {
+                hit = vma;
+                break;
+            }
+        }
+        if(!hit)
+            return start;
+        // Try right below the area in the way
+        if(hit->start < bottom + size)
+            return 0;
+        start = hit->start - size;
+    }
+    return 0;
+}
+
+/*
+ * Clip an area to [start, end), the part of the file it reads from moves along
+ * */
+static void vma_clip(vm_area_t * vma, uint32_t start, uint32_t end) {
+    if(vma->file) {
+        uint32_t data_start = max(vma->data_start, start);
+        uint32_t data_end = max(min(vma->data_end, end), data_start);
+        vma->file_offset += data_start - vma->data_start;
+        vma->data_start = data_start;
+        vma->data_end = data_end;
+    }
+    vma->start = start;
+    vma->end = end;
+}
+
+/*
+ * Take the pages of [start, end) out of the list, areas are shrunk, split or freed as needed
+ * The pages themselves have to be unmapped by the caller
+ * */
+void vma_remove(vm_area_t ** list, uint32_t start, uint32_t end) {
+    start = start & 0xfffff000;
+    end = ALIGN(end, PAGE_SIZE);
+    vm_area_t ** link = list;
+    while(*link) {
+        vm_area_t * vma = *link;
+        if(end <= vma->start || vma->end <= start) {
+            link = &vma->next;
+            continue;
+        }
+        if(start <= vma->start && vma->end <= end) {
+            // Entirely gone
+            *link = vma->next;
+            kmem_cache_free(vma_cache, vma);
+            continue;
+        }
+        if(vma->start < start && end < vma->end) {
+            // A hole in the middle, the upper part becomes an area of its own
+            vm_area_t * upper = vma_alloc();
+            *upper = *vma;
+            vma_clip(upper, end, vma->end);
+            vma_clip(vma, vma->start, start);
+            upper->next = vma->next;
+            vma->next = upper;
+            link = &upper->next;
+            continue;
+        }
+        if(vma->start < start)
+            vma_clip(vma, vma->start, start);
+        else
+            vma_clip(vma, end, vma->end);
+        link = &vma->next;
+    }
+}
+
+/*
+ * Fill a freshly mapped page, it must be mapped in the current address space(and already zeroed, allocate_page gives user pages zeroed frames)
+ * Segments don't have to be page aligned, so a page can be shared by two areas(end of text and start of data for example), copy from every area that overlaps it
+ * */
+void vma_fill_page(vm_area_t * list, uint32_t page_addr) {
+    uint32_t page_end = page_addr + PAGE_SIZE;
+    for(vm_area_t * vma = list; vma; vma = vma->next) {
+        if(!vma->file || (vma->flags & VMA_PAGECACHE)) continue;
+        uint32_t from = max(page_addr, vma->data_start);
+        uint32_t to = min(page_end, vma->data_end);
+        if(from >= to) continue;
+        vfs_read(vma->file, vma->file_offset + (from - vma->data_start), to - from, (char*)from);
+    }
+}
+
+/*
+ * Duplicate a list of areas, for fork
+ * */
+vm_area_t * vma_copy_list(vm_area_t * list) {
+    vm_area_t * ret = NULL, ** tail = &ret;
+    for(vm_area_t * vma = list; vma; vma = vma->next) {
+        vm_area_t * copy = vma_alloc();
+        *copy = *vma;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+    }
+    return ret;
+}
+
+void vma_destroy_list(vm_area_t * list) {
+    while(list) {
+        vm_area_t * next = list->next;
+        kmem_cache_free(vma_cache, list);
+        list = next;
+    }
+}
@@ -7,6 +7,7 @@
 arp_table_entry_t arp_table[512];
 int arp_table_size;
 int arp_table_curr;
+wait_queue_t arp_wait_queue;
 
 uint8_t broadcast_mac_address[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
@@ -70,7 +71,7 @@ void arp_handle_packet(arp_packet_t * arp_packet, int len) {
     // Wrap around
     if(arp_table_curr >= 512)
         arp_table_curr = 0;
-
+    wake_up(&arp_wait_queue);
 }
 
 void arp_send_packet(uint8_t * dst_hardware_addr, uint8_t * dst_protocol_addr) {
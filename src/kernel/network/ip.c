@@ -6,6 +6,7 @@
 #include <network_utils.h>
 #include <dhcp.h>
 #include <udp.h>
+#include <timer.h>
 
 uint8_t my_ip[] = {10, 0, 2, 14};
 uint8_t test_target_ip[] = {10, 0, 2, 15};
@@ -90,6 +91,8 @@ void ip_send_packet(uint8_t * dst_ip, void * data, int len) {
             // Send an arp packet here
             arp_send_packet(zero_hardware_addr, dst_ip);
         }
+        // Sleep until arp_handle_packet adds the reply, ask again if it doesn't come in time
+        wait_event_timeout(&arp_wait_queue, arp_lookup(dst_hardware_addr, dst_ip), ARP_TIMEOUT_MS * hz / 1000);
     }
     qemu_printf("IP Packet Sent...(checksum: %x)\n", packet->header_checksum);
     // Got the mac address! Now send an ethernet packet
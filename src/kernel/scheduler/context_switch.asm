@@ -1,89 +1,48 @@
-;Context switch function, its c prototype is the following
-;void switch_task(task_regs_t * curr_regs, task_regs_t * next_regs);
-;Basically, it saves current cpu registers to 'curr_regs', and then load 'next_regs' to current cpu registers
-; Equivalent c prototype void regs_switch(context_t * regs);
+;Context switch, every task has a kernel stack of its own and switches on it, its c prototype is the following
+;void switch_to(uint32_t * prev_kesp, uint32_t next_kesp);
+;Only the callee saved registers are pushed, the caller saved ones are already on the stack of schedule()'s callers, and the user mode registers
+;are in the interrupt frame at the top of the kernel stack, so nothing has to be copied around
 
-global user_regs_switch
-global kernel_regs_switch
-user_regs_switch:
-    ; Load general registers
-    ; Skip return address, and get the pointer regs
-    mov ebp, [esp + 4]
-    mov ecx, [ebp + 4]
-    mov edx, [ebp + 8]
-    mov ebx, [ebp + 12]
-    mov esi, [ebp + 24]
-    mov edi, [ebp + 28]
-    ; load eflags
-    ;mov eax, [ebp + 32]
-    ;push eax
-    ;popfd
-    ; Right now, eax, ebp, esp are not restored yet
+global switch_to
+global task_entry_user
+global task_entry_kernel
+global task_start
+extern schedule_tail
+switch_to:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    ; Save the current task's kernel stack pointer and move to the next one's
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ; Returns into the next task's schedule(), or to the entry point task_stack_init() set up for a new task
+    ret
 
-    ; Enter usermode from here(make sure the registers are restored correctly for the user process !)
-    mov ax, 0x23
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-    
-    push 0x23
-    ; Push user esp
-    mov eax, [ebp + 16]
-    push eax
-    mov eax, [ebp + 32]
-    push eax
-    ;pushfd
-    push 0x1b
-    ; Push eip
-    mov eax, [ebp + 40]
-    push eax
-    ; Enter usermode from here(make sure the registers are restored correctly for the user process !)
+; Every new task starts here, schedule() switched to it holding the big kernel lock, which the task doesn't hold itself, then it goes on to its entry point
+task_start:
+    call schedule_tail
+    ret
 
-    ; Load eax here
-    mov eax, [ebp + 0]
-    ; Now, restore ebp
-    mov ebp, [ebp + 20]
-    ; sti
+; First switch_to() to a new process (or to one created by fork) returns here, the stack holds the user mode registers
+; the same way as an interrupt frame does, so leave the kernel the way the interrupt handlers do
+task_entry_user:
+    pop ebx
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+    popa
+    add esp, 0x8                    ; skip int_no and err_code
     iret
 
-kernel_regs_switch:
-    ; Load general registers
-    ; Skip return address, and get the pointer regs
-    mov ebp, [esp + 4]
-    mov ecx, [ebp + 4]
-    mov edx, [ebp + 8]
-    mov ebx, [ebp + 12]
-    mov esi, [ebp + 24]
-    mov edi, [ebp + 28]
-    ; load eflags
-    mov eax, [ebp + 32]
-    push eax
-    popfd
-    ; Right now, eax, ebp, esp are not restored yet
-
-    ; Enter usermode from here(make sure the registers are restored correctly for the user process !)
-    mov ax, 0x10
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-    
-    push 0x10
-    ; Push user esp
-    mov eax, [ebp + 16]
-    push eax
-    pushfd
-    push 0x08
-    ; Push eip
-    mov eax, [ebp + 40]
-    push eax
-    ; Enter usermode from here(make sure the registers are restored correctly for the user process !)
-
-    ; Load eax here
-    mov eax, [ebp + 0]
-    ; Now, restore ebp
-    mov ebp, [ebp + 20]
+; First switch_to() to a kernel thread (or the idle task) returns here, schedule() had interrupts off, the entry point is the next return address
+task_entry_kernel:
     sti
-    iret
-
+    ret
@@ -0,0 +1,50 @@
+#include <thread.h>
+#include <slab.h>
+#include <smp.h>
+
+// Defined in process.c
+extern kmem_cache_t * pcb_cache;
+
+/*
+ * Kernel threads
+ * A kernel thread runs fn(arg) in ring 0 on a stack of its own, it has no address space of its own and keeps using whichever one is loaded(there's no cr3 reload when switching to it),
+ * the kernel half is the same everywhere. So it's only a pcb and a stack, instead of a page directory, its page tables and a user stack like create_process_from_routine()
+ * A kernel thread runs without the big kernel lock(so it can be preempted), it takes lock_kernel() around anything that touches shared kernel state
+ * */
+
+/*
+ * Create a kernel thread and make it runnable, it exits when fn returns
+ * */
+pcb_t * kthread_create(kthread_fn fn, void * arg) {
+    lock_kernel();
+    pcb_t * t = kmem_cache_zalloc(pcb_cache);
+    t->pid = allocate_pid();
+    strcpy(t->filename, "kthread");
+    t->flags = PF_KTHREAD;
+    t->kstack = kmalloc(KSTACK_SIZE);
+
+    // Make the stack look like fn was called with arg, by kthread_exit, task_entry_kernel returns into fn
+    uint32_t * sp = (uint32_t*)(t->kstack + KSTACK_SIZE);
+    *--sp = (uint32_t)arg;
+    *--sp = (uint32_t)kthread_exit;
+    *--sp = (uint32_t)fn;
+    t->kesp = task_stack_init(sp, task_entry_kernel);
+    t->state = TASK_CREATED;
+
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    t->self = list_insert_front(process_list, t);
+    sched_enqueue(t);
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+    unlock_kernel();
+    return t;
+}
+
+/*
+ * Stop the calling kernel thread, the next schedule() frees its pcb and its stack
+ * */
+void kthread_exit() {
+    asm volatile("cli");
+    current_process->state = TASK_ZOMBIE;
+    schedule();
+}
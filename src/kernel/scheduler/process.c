@@ -1,95 +1,441 @@
 #include <process.h>
 #include <pic.h>
 #include <serial.h>
+#include <slab.h>
+#include <pmm.h>
+#include <tss.h>
+#include <thread.h>
+#include <fpu.h>
+#include <smp.h>
+#include <apic.h>
 
 
 list_t * process_list;
-pcb_t * current_process;
-pcb_t * last_process;
+kmem_cache_t * pcb_cache;
 
 uint32_t prev_jiffies;
 pid_t curr_pid;
-// Whenever interrupt/exception/syscall(which is soft exception) happens, we should store the context from previous process in here, so that scheduler can use it
-register_t saved_context;
+
+// Scheduler state of every cpu, cpus[0] is the bsp, see smp.c for the others
+cpu_t cpus[MAX_CPUS];
+uint32_t num_cpus = 1;
+// Tasks waiting for something, they're not looked at until sched_wakeup()
+list_t * blocked_list;
+// Charges a jiffy to the running task, only armed while there's something to schedule(the local apic timers do it instead once they run)
+ktimer_t sched_timer;
+ktimer_t sched_stats_timer;
+// Ping-pong benchmark state, see sched_benchmark()
+uint64_t bench_start;
+uint32_t bench_done;
 
 pid_t allocate_pid() {
     return curr_pid++;
 }
 /*
- * Yeah, context switch, what else to put here ?...
+ * Build the bottom of a new task's kernel stack, so that the first switch_to() to it returns to ret(through task_start, which gives back the big kernel lock), returns the task's kesp
+ * */
+uint32_t task_stack_init(uint32_t * sp, void * ret) {
+    *--sp = (uint32_t)ret;
+    *--sp = (uint32_t)task_start;
+    // ebp, ebx, esi, edi
+    for(int i = 0; i < 4; i++)
+        *--sp = 0;
+    return (uint32_t)sp;
+}
+
+/*
+ * Give a new process a kernel stack, the user mode registers it starts with are at the top, task_entry_user pops them(after entry returns, if there's one)
+ * */
+static void task_init_user(pcb_t * p, uint32_t eip, uint32_t esp, void * entry) {
+    p->kstack = kmalloc(KSTACK_SIZE);
+    register_t * frame = task_frame(p);
+    memset(frame, 0, sizeof(register_t));
+    frame->ds = 0x23;
+    frame->cs = 0x1b;
+    frame->ss = 0x23;
+    frame->eflags = 0x202; // enable interrupt
+    frame->eip = eip;
+    frame->useresp = esp;
+    uint32_t * sp = (uint32_t*)frame;
+    if(entry) {
+        *--sp = (uint32_t)task_entry_user;
+        p->kesp = task_stack_init(sp, entry);
+    }
+    else
+        p->kesp = task_stack_init(sp, task_entry_user);
+}
+
+static uint32_t sched_slice(uint32_t priority) {
+    return (priority + 1) * SCHED_BASE_SLICE;
+}
+
+/*
+ * The online cpu with the fewest tasks, where a new task goes
+ * */
+static cpu_t * sched_idlest_cpu() {
+    cpu_t * best = this_cpu();
+    uint32_t best_load = best->nr_queued + (best->current != NULL);
+    for(uint32_t i = 0; i < num_cpus; i++) {
+        cpu_t * c = &cpus[i];
+        uint32_t load = c->nr_queued + (c->current != NULL);
+        if(c->online && load < best_load) {
+            best = c;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static void sched_queue(cpu_t * c, pcb_t * p) {
+    p->cpu = c;
+    p->rq_node = list_insert_back(c->run_queue[p->priority], p);
+    c->run_bitmap |= 1 << p->priority;
+    c->nr_queued++;
+}
+
+/*
+ * Put a runnable task at the back of its priority level, on the cpu it last ran on(a new one goes to the least busy cpu)
  * */
-void context_switch(register_t * p_regs, context_t * n_regs) {
-    // Save registers of current running process to memory(which is current_process->regs)
-    if(last_process) {
-        last_process->regs.eax = p_regs->eax;
-        last_process->regs.ebx = p_regs->ebx;
-        last_process->regs.ecx = p_regs->ecx;
-        last_process->regs.edx = p_regs->edx;
-        last_process->regs.esi = p_regs->esi;
-        last_process->regs.edi = p_regs->edi;
-        last_process->regs.ebp = p_regs->ebp;
-        last_process->regs.esp = p_regs->useresp;
-        last_process->regs.eflags = p_regs->eflags;
-        last_process->regs.eip = p_regs->eip;
-        asm volatile("mov %%cr3, %0" : "=r"(last_process->regs.cr3));
+void sched_enqueue(pcb_t * p) {
+    if(!p->cpu)
+        p->cpu = sched_idlest_cpu();
+    sched_queue(p->cpu, p);
+    if(!apic_enabled && !timer_pending(&sched_timer))
+        timer_start(&sched_timer, TIMER_JIFFY, TIMER_JIFFY);
+}
+
+static pcb_t * sched_take(cpu_t * c, uint32_t priority) {
+    pcb_t * p = list_remove_front(c->run_queue[priority]);
+    if(!list_size(c->run_queue[priority]))
+        c->run_bitmap &= ~(1 << priority);
+    c->nr_queued--;
+    p->rq_node = NULL;
+    return p;
+}
+
+/*
+ * Even out the run queues, move the most urgent task of the busiest cpu over if that cpu has SCHED_IMBALANCE more queued than we do,
+ * or any at all while we have none
+ * */
+static void sched_balance(cpu_t * c) {
+    cpu_t * busiest = NULL;
+    for(uint32_t i = 0; i < num_cpus; i++) {
+        if(&cpus[i] != c && cpus[i].online && (!busiest || cpus[i].nr_queued > busiest->nr_queued))
+            busiest = &cpus[i];
     }
+    if(!busiest || !busiest->nr_queued)
+        return;
+    if(c->nr_queued && busiest->nr_queued < c->nr_queued + SCHED_IMBALANCE)
+        return;
+    pcb_t * p = sched_take(busiest, __builtin_ctz(busiest->run_bitmap));
+    sched_queue(c, p);
+}
+
+/*
+ * Take the first task of the highest non empty level, the lowest set bit of run_bitmap tells which one
+ * */
+static pcb_t * sched_pick(cpu_t * c) {
+    if(num_cpus > 1)
+        sched_balance(c);
+    if(!c->run_bitmap) return NULL;
+    return sched_take(c, __builtin_ctz(c->run_bitmap));
+}
+
+static void sched_dequeue(pcb_t * p) {
+    cpu_t * c = p->cpu;
+    list_remove_node(c->run_queue[p->priority], p->rq_node);
+    if(!list_size(c->run_queue[p->priority]))
+        c->run_bitmap &= ~(1 << p->priority);
+    c->nr_queued--;
+    p->rq_node = NULL;
+}
+
+/*
+ * Take a task off the run queues until sched_wakeup(), if it's the running task the caller has to schedule() afterwards
+ * */
+void sched_block(pcb_t * p) {
+    if(p->state == TASK_INTERRUPTIBLE) return;
+    if(p->rq_node)
+        sched_dequeue(p);
+    p->state = TASK_INTERRUPTIBLE;
+    p->rq_node = list_insert_front(blocked_list, p);
+}
+
+/*
+ * Make a blocked task runnable again, it preempts the running task at the next tick if it has a higher priority
+ * */
+void sched_wakeup(pcb_t * p) {
+    if(p->state != TASK_INTERRUPTIBLE) return;
+    list_remove_node(blocked_list, p->rq_node);
+    p->rq_node = NULL;
+    p->state = TASK_RUNNING;
+    // Woken up before it got to schedule() away, it just carries on
+    if(p == current_process) return;
+    sched_enqueue(p);
+    cpu_t * c = p->cpu;
+    if(!c->current || p->priority < c->current->priority) {
+        c->need_resched = 1;
+        // Another cpu only notices at its next tick, or right away if it's poked
+        if(c != this_cpu())
+            lapic_send_ipi(c->apic_id, RESCHED_VECTOR);
+    }
+}
+
+/*
+ * Move every task of this cpu back to level 0, done every SCHED_BOOST_TICKS
+ * */
+static void sched_boost(cpu_t * c) {
+    for(uint32_t i = 1; i < SCHED_PRIORITIES; i++) {
+        while(list_size(c->run_queue[i])) {
+            pcb_t * p = sched_take(c, i);
+            p->priority = 0;
+            sched_queue(c, p);
+        }
+    }
+    foreach(t, blocked_list) {
+        pcb_t * p = t->val;
+        if(p->cpu == c)
+            p->priority = 0;
+    }
+    if(c->current)
+        c->current->priority = 0;
+}
+
+/*
+ * Called every jiffy on every cpu(by sched_timer, or the local apic timer), it charges the tick to the running task and decides whether it should be preempted
+ * */
+static void scheduler_tick(void * data) {
+    cpu_t * c = this_cpu();
+    if(!c->current && !c->run_bitmap) {
+        // Nothing to run, no need for the timer to go off until a task becomes runnable again(the local apic timers keep ticking, an idle cpu looks for work to take)
+        if(!apic_enabled)
+            timer_cancel(&sched_timer);
+        else if(num_cpus > 1 && c->running)
+            c->need_resched = 1;
+        return;
+    }
+    if(jiffies - c->boost_jiffies >= SCHED_BOOST_TICKS) {
+        c->boost_jiffies = jiffies;
+        sched_boost(c);
+    }
+
+    if(!c->current) {
+        if(c->run_bitmap)
+            c->need_resched = 1;
+        return;
+    }
+
+    if(c->current->time_slice)
+        c->current->time_slice--;
+    if(!c->current->time_slice) {
+        // Used up its whole slice, it's probably cpu bound, move it down a level
+        if(c->current->priority < SCHED_PRIORITIES - 1)
+            c->current->priority++;
+        c->need_resched = 1;
+    }
+    else if(c->run_bitmap & ((1 << c->current->priority) - 1)) {
+        // Something with a higher priority became runnable
+        c->need_resched = 1;
+    }
+}
 
+/*
+ * Local apic timer irq, the scheduler tick of every cpu once the apics are up
+ * */
+void sched_lapic_tick(register_t * reg) {
+    scheduler_tick(NULL);
+    sched_preempt(reg);
+}
+
+/*
+ * Called at the end of an irq handler, switch tasks if need_resched is set and the interrupted code can be preempted
+ * The kernel side of a process isn't written to be preempted, it only gives up the cpu where it blocks, kernel threads are, unless they hold the big kernel lock(the handler's own is the only one)
+ * */
+void sched_preempt(register_t * reg) {
+    cpu_t * c = this_cpu();
+    if(!c->need_resched || c->lock_depth > 1)
+        return;
+    if((reg->cs & 0x3) == 0x3 || !c->current || (c->current->flags & PF_KTHREAD))
+        schedule();
+}
+
+/*
+ * Charge the time since the last switch to either the idle task or the tasks
+ * */
+static void sched_account(cpu_t * c) {
+    uint64_t now = timer_now();
+    uint32_t delta = now - c->account_stamp;
+    c->account_stamp = now;
+    uint32_t * total = c->idle_running ? &c->idle_jiffies : &c->busy_jiffies;
+    uint32_t * rest = c->idle_running ? &c->idle_rest : &c->busy_rest;
+    *rest += delta;
+    *total += *rest / TIMER_JIFFY;
+    *rest %= TIMER_JIFFY;
+}
+
+/*
+ * The idle task, halt until the next interrupt, and make use of the time by zeroing frames for pmm_alloc_zeroed()
+ * */
+static void idle_loop() {
+    for(;;) {
+        // One frame at a time with interrupts off, so a wakeup isn't held up for long
+        asm volatile("cli");
+        lock_kernel();
+        while(!this_cpu()->need_resched && pmm_zero_pool_refill(1)) {
+            // Let the other cpus in too
+            unlock_kernel();
+            asm volatile("sti; nop; cli");
+            lock_kernel();
+        }
+        unlock_kernel();
+        // sti only takes effect after the next instruction, so an interrupt can't slip in between and leave us halted
+        asm volatile("sti; hlt");
+    }
+}
 
-    // Switch page directory
-    if(((page_directory_t*)n_regs->cr3) != NULL) {
-        //uint32_t t = virtual2phys(kpage_dir, kpage_dir);
-        //switch_page_directory(t, 1);
-        switch_page_directory((page_directory_t*)n_regs->cr3, 1);
+/*
+ * Print the cpu utilization, how much memory every process has mapped(its resident set) and how much is left
+ * */
+void sched_print_stats() {
+    lock_kernel();
+    sched_account(this_cpu());
+    for(uint32_t i = 0; i < num_cpus; i++) {
+        cpu_t * c = &cpus[i];
+        uint32_t total = c->busy_jiffies + c->idle_jiffies;
+        qemu_printf("Cpu %u time: %u jiffies busy, %u jiffies idle, %u%% utilization\n", i, c->busy_jiffies, c->idle_jiffies, total ? c->busy_jiffies * 100 / total : 0);
+    }
+    foreach(t, process_list) {
+        pcb_t * p = t->val;
+        // Kernel threads have no address space of their own
+        if(!p->page_dir) continue;
+        qemu_printf("Task %u(%s): %u resident pages(%u kb)\n", p->pid, p->filename, p->resident_pages, p->resident_pages * (PAGE_SIZE / 1024));
     }
-    // Load regs(memory) to the real registers
-    irq_ack(0);
-    last_process = current_process;
-    user_regs_switch(n_regs);
-    //if(current_process->state == TASK_CREATED || current_process->state == TASK_LOADING)
-    //    kernel_regs_switch(n_regs);
-    //else if(current_process->state == TASK_RUNNING)
+    pmm_print_stats();
+    unlock_kernel();
 }
 
+static void sched_stats_tick(void * data) {
+    sched_print_stats();
+}
 
 /*
- * This function is registered to the timer wakeup list, so it will be wakeup every 2/18 seconds
+ * Print the scheduler and memory statistics every sec seconds, 0 stops it
+ * */
+void sched_stats_periodic(uint32_t sec) {
+    if(!sec) {
+        timer_cancel(&sched_stats_timer);
+        return;
+    }
+    timer_setup(&sched_stats_timer, sched_stats_tick, NULL);
+    timer_start(&sched_stats_timer, TIMER_SEC(sec), TIMER_SEC(sec));
+}
+
+/*
+ * Pick the next task to run, called from the timer handler when need_resched is set, or by a task giving up the cpu(syscall 1, _exit)
+ * The big kernel lock stays with the cpu across the switch, the task switched to gives it back as far as it had taken it
  * */
 void schedule() {
 #if DEBUG_MULTITASK
     qemu_printf("Process Scheduler running\n");
 #endif
-    pcb_t * next;
-    if(!list_size(process_list)) return;
-
-    if(!current_process) {
-        // First process, this will only happen when we create the user entry process, we'll make sure this first process never exits
-        prev_jiffies = jiffies;
-        current_process = list_peek_front(process_list);
-        last_process = NULL;
-        context_switch(NULL, &current_process->regs);
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    lock_kernel();
+    cpu_t * c = this_cpu();
+    int preempted = c->need_resched;
+    c->need_resched = 0;
+    sched_account(c);
+    if(c->dead_task) {
+        fpu_release(c->dead_task);
+        kfree(c->dead_task->kstack);
+        kmem_cache_free(pcb_cache, c->dead_task);
+        c->dead_task = NULL;
     }
 
-    // save next process's listnode
-    listnode_t * nextnode = (current_process->self)->next;
-    if(current_process->state == TASK_ZOMBIE) {
-        // Make sure we won't choose a zombie process to be run next
-        list_remove_node(process_list, current_process->self);
-        last_process = NULL;
+    pcb_t * prev = c->current;
+    if(prev) {
+        if(prev->state == TASK_ZOMBIE) {
+            // Zombies never go back into a run queue, _exit already gave back its memory, only the pcb and the kernel stack we're on are left
+            list_remove_node(process_list, prev->self);
+            c->dead_task = prev;
+        }
+        else if(!prev->rq_node) {
+            // Still runnable(a blocked task sits in the blocked list), one that gave up the cpu before its slice ran out moves up a level
+            if(!preempted && prev->time_slice && prev->priority)
+                prev->priority--;
+            sched_queue(c, prev);
+        }
     }
 
-    // choose next process
-    if(!nextnode)
-        next = list_peek_front(process_list);
-    else
-        next = nextnode->val;
-
-    current_process = next;
-    if(current_process == NULL)
-        PANIC("no process left, did you exit all user process ??? Never exit the userspace init process!!!!");
+    pcb_t * next = sched_pick(c);
+    c->idle_running = next == NULL;
+    if(c->idle_running) {
+        // Everyone is blocked(or there's no process at all), the timer handler calls schedule() again from the idle task once something is woken up
+        next = c->idle;
+        c->current = NULL;
+    }
+    else {
+        if(!next->time_slice)
+            next->time_slice = sched_slice(next->priority);
+        c->current = next;
+    }
 #if DEBUG_MULTITASK
-    qemu_printf("Scheduler chose %s to run at 0x%08x\n", current_process->filename, current_process->regs.eip);
+    qemu_printf("Cpu %u chose %s(priority %d)\n", c->id, next->filename, next->priority);
 #endif
-    context_switch(&saved_context, &next->regs);
+
+    if(next != c->running) {
+        uint32_t loaded_cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(loaded_cr3));
+        if(next->cr3) {
+            if(next->cr3 != loaded_cr3)
+                switch_page_directory((page_directory_t*)next->cr3);
+        }
+        else if(num_cpus > 1 && loaded_cr3 != (uint32_t)kpage_dir) {
+            // Kernel threads keep whatever address space is loaded, but with other cpus around, its process may exit and free it meanwhile
+            switch_page_directory(kpage_dir);
+        }
+        // Interrupts from user mode land on the task's own kernel stack
+        tss_set_stack(0x10, (uint32_t)next->kstack + KSTACK_SIZE);
+        fpu_switch(c->running, next);
+        pcb_t * prev_task = c->running;
+        c->running = next;
+        if(prev_task)
+            prev_task->lock_depth = c->lock_depth;
+        switch_to(prev_task ? &prev_task->kesp : &c->boot_kesp, next->kesp);
+        // We're back, something switched to this task again, maybe on another cpu
+        c = this_cpu();
+        c->lock_depth = c->running->lock_depth;
+    }
+    unlock_kernel();
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+/*
+ * A new task starts here(see task_start), it got the cpu from schedule() with the big kernel lock, which it doesn't hold itself
+ * */
+void schedule_tail() {
+    cpu_t * c = this_cpu();
+    c->lock_depth = 1;
+    unlock_kernel();
+}
+
+/*
+ * Give a cpu its idle task and its run queues, it starts scheduling at its first schedule()
+ * */
+void sched_start_cpu(cpu_t * c) {
+    c->idle = kmem_cache_zalloc(pcb_cache);
+    c->idle->pid = allocate_pid();
+    strcpy(c->idle->filename, "idle");
+    c->idle->flags = PF_KTHREAD;
+    c->idle->cpu = c;
+    c->idle->kstack = kmalloc(KSTACK_SIZE);
+    uint32_t * sp = (uint32_t*)(c->idle->kstack + KSTACK_SIZE);
+    *--sp = (uint32_t)idle_loop;
+    c->idle->kesp = task_stack_init(sp, task_entry_kernel);
+    c->idle->state = TASK_RUNNING;
+    for(int i = 0; i < SCHED_PRIORITIES; i++)
+        c->run_queue[i] = list_create();
+    c->account_stamp = timer_now();
 }
 
 
@@ -98,63 +444,117 @@ void schedule() {
  * */
 void create_process(char * filename) {
     // Create and insert a process, the pcb struct is in kernel space
-    pcb_t * p1 = kcalloc(sizeof(pcb_t), 1);
+    pcb_t * p1 = kmem_cache_zalloc(pcb_cache);
     p1->pid = allocate_pid();
-    p1->regs.eip = (uint32_t)do_elf_load;
-    p1->regs.eflags = 0x206; // enable interrupt
-    p1->self = list_insert_front(process_list, p1);
     strcpy(p1->filename, filename);
 
-    // 4kb initial stack
+    // The process starts in do_elf_load on its kernel stack, which fills in the entry point and the stack of the user mode registers
     p1->stack = (void*)0xC0000000;
-    p1->regs.esp = (0xC0000000 - 4 * 1024);
+    task_init_user(p1, 0, 0xC0000000, do_elf_load);
+    // The loader moves the heap right after the executable
+    p1->brk_start = p1->brk = USER_HEAP_START;
 
     // Create an address space for the process, how ?
-    // kmalloc a page directory for the process, then copy the entire kernel page dirs and tables(the frames don't have to be copied though)
-    p1->page_dir = kmalloc_a(sizeof(page_directory_t));
-    memset(p1->page_dir, 0, sizeof(page_directory_t));
+    // Allocate a page directory for the process, then copy the entire kernel page dirs and tables(the frames don't have to be copied though)
+    p1->page_dir = alloc_page_directory();
+    if(!p1->page_dir) {
+        qemu_printf("create_process: out of memory\n");
+        kfree(p1->kstack);
+        kmem_cache_free(pcb_cache, p1);
+        return;
+    }
     copy_page_directory(p1->page_dir, kpage_dir);
-    p1->regs.cr3 = (uint32_t)virtual2phys(kpage_dir, p1->page_dir);
+    p1->cr3 = (uint32_t)p1->page_dir;
     p1->state = TASK_CREATED;
 
-    // Now, the process has its own address space, stack,
-    // schedule
-    asm volatile("mov $1, %eax");
-    asm volatile("int $0x80");
+    // Now, the process has its own address space, stack, it runs once it's picked
+    p1->self = list_insert_front(process_list, p1);
+    sched_enqueue(p1);
 }
 
 /*
  * Create a new process, load a program from filesystem and run it
  * */
 void create_process_from_routine(void * routine, char * name) {
-    pcb_t * p1 = kcalloc(sizeof(pcb_t), 1);
+    pcb_t * p1 = kmem_cache_zalloc(pcb_cache);
     p1->pid = allocate_pid();
-    p1->regs.eip = (uint32_t)routine;
-    p1->regs.eflags = 0x206; // enable interrupt
     strcpy(p1->filename, name);
 
     // 4kb initial stack
-    p1->regs.esp = 0xC0000000;
+    task_init_user(p1, (uint32_t)routine, 0xC0000000, NULL);
+    p1->brk_start = p1->brk = USER_HEAP_START;
 
     // Create an address space for the process, how ?
-    // kmalloc a page directory for the process, then copy the entire kernel page dirs and tables(the frames don't have to be copied though)
-    p1->page_dir = kmalloc_a(sizeof(page_directory_t));
-    memset(p1->page_dir, 0, sizeof(page_directory_t));
+    // Allocate a page directory for the process, then copy the entire kernel page dirs and tables(the frames don't have to be copied though)
+    p1->page_dir = alloc_page_directory();
+    if(!p1->page_dir) {
+        qemu_printf("create_process_from_routine: out of memory\n");
+        kfree(p1->kstack);
+        kmem_cache_free(pcb_cache, p1);
+        return;
+    }
     copy_page_directory(p1->page_dir, kpage_dir);
+    // On the process list first, so the stack pages count as its resident pages
+    p1->self = list_insert_front(process_list, p1);
      allocate_region(p1->page_dir, 0xC0000000 - 4 * PAGE_SIZE, 0xC0000000, 0, 0, 1);
-    p1->regs.cr3 = (uint32_t)virtual2phys(kpage_dir, p1->page_dir);
+    p1->cr3 = (uint32_t)p1->page_dir;
     p1->state = TASK_CREATED;
-    if(!current_process)
-        current_process = p1;
-    p1->self = list_insert_front(process_list, p1);
+    sched_enqueue(p1);
     qemu_printf("%s created\n", name);
 }
 
+static void sched_benchmark_report(char * what) {
+    uint32_t cycles = (uint32_t)(rdtsc() - bench_start) / SCHED_BENCHMARK_SWITCHES;
+    qemu_printf("  %s: %u cycles per switch\n", what, cycles);
+}
+
+static void sched_benchmark_user() {
+    if(!bench_start)
+        bench_start = rdtsc();
+    for(uint32_t i = 0; i < SCHED_BENCHMARK_SWITCHES / 2; i++)
+        asm volatile("int $0x80" : : "a"(1) : "memory", "ecx", "edx");
+    if(++bench_done == 2)
+        sched_benchmark_report("between processes(cr3 reload, return to user mode)");
+    asm volatile("int $0x80" : : "a"(4));
+}
+
+static void sched_benchmark_kthread(void * arg) {
+    if(!bench_start)
+        bench_start = rdtsc();
+    for(uint32_t i = 0; i < SCHED_BENCHMARK_SWITCHES / 2; i++)
+        schedule();
+    if(++bench_done == 2) {
+        sched_benchmark_report("between kernel threads");
+        // Now the same with two processes yielding through the syscall
+        bench_start = 0;
+        bench_done = 0;
+        create_process_from_routine(sched_benchmark_user, "benchmark ping");
+        create_process_from_routine(sched_benchmark_user, "benchmark pong");
+    }
+}
+
+/*
+ * Ping-pong between two tasks that give the cpu to each other SCHED_BENCHMARK_SWITCHES times, first two kernel threads, then two processes
+ * Start nothing else, or it'll get a share of the switches
+ * */
+void sched_benchmark() {
+    qemu_printf("scheduler benchmark(%u switches):\n", SCHED_BENCHMARK_SWITCHES);
+    bench_start = 0;
+    bench_done = 0;
+    kthread_create(sched_benchmark_kthread, NULL);
+    kthread_create(sched_benchmark_kthread, NULL);
+}
+
 /*
  * Init process scheduler
  * */
 void process_init() {
     process_list = list_create();
-    // Tell the timer to call our process_scheduler every 2/18 seconds
-    register_wakeup_call(schedule, 30.0/hz);
+    pcb_cache = kmem_cache_create("pcb_t", sizeof(pcb_t));
+    blocked_list = list_create();
+    // Armed by sched_enqueue() once there's something to run
+    timer_setup(&sched_timer, scheduler_tick, NULL);
+
+    cpus[0].online = 1;
+    sched_start_cpu(&cpus[0]);
 }
@@ -0,0 +1,245 @@
+#include <smp.h>
+#include <apic.h>
+#include <pic.h>
+#include <gdt.h>
+#include <idt.h>
+#include <tss.h>
+#include <fpu.h>
+#include <paging.h>
+#include <kheap.h>
+#include <timer.h>
+#include <serial.h>
+
+/*
+ * Symmetric multiprocessing
+ * The cpus are found in the mp configuration table the bios leaves below 1mb(no acpi parser needed), the bsp switches from the pics to the io apic,
+ * then wakes every application processor with INIT and two STARTUP ipis. An ap starts in real mode in the trampoline at TRAMPOLINE_BASE,
+ * which enters protected mode and paging with the bsp's page directory, and jumps to ap_start().
+ * All cpus share the gdt and idt, each has its own tss, local apic timer(its scheduler tick) and run queues, see process.c.
+ * The kernel itself isn't reentrant across cpus, a big kernel lock serializes everything in it: interrupt, exception and syscall handlers and schedule() take it,
+ * so only user mode code and kernel threads really run in parallel. Device irqs all go to the bsp.
+ * */
+
+// Only one cpu at a time is in the kernel, see lock_kernel()
+spinlock_t kernel_lock = SPINLOCK_INIT("kernel");
+// Index of the application processor being started, for ap_start()
+volatile uint32_t smp_booting;
+
+// Defined in process.c
+extern ktimer_t sched_timer;
+
+/*
+ * Take the big kernel lock, a cpu can take it again while it holds it, it's released by the matching unlock_kernel()
+ * schedule() hands it to the next task, so a task giving up the cpu gives up the lock too
+ * */
+void lock_kernel() {
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    if(!this_cpu()->lock_depth++)
+        spinlock_lock(&kernel_lock);
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+void unlock_kernel() {
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    if(!--this_cpu()->lock_depth)
+        spinlock_unlock(&kernel_lock);
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+static uint8_t mp_checksum(void * addr, uint32_t len) {
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < len; i++)
+        sum += ((uint8_t*)addr)[i];
+    return sum;
+}
+
+static mp_floating_t * mp_search(uint32_t start, uint32_t len) {
+    for(uint32_t addr = start; addr + sizeof(mp_floating_t) <= start + len; addr += 16) {
+        mp_floating_t * mp = (mp_floating_t*)(LOAD_MEMORY_ADDRESS + addr);
+        if(!memcmp((uint8_t*)mp->signature, (uint8_t*)"_MP_", 4) && !mp_checksum(mp, mp->length * 16))
+            return mp;
+    }
+    return NULL;
+}
+
+/*
+ * The floating pointer is in the first kb of the ebda, the last kb of base memory, or the bios rom
+ * */
+static mp_floating_t * mp_find() {
+    mp_floating_t * mp;
+    uint32_t ebda = *(uint16_t*)(LOAD_MEMORY_ADDRESS + MP_EBDA_SEGMENT_PTR) << 4;
+    if(ebda && (mp = mp_search(ebda, 1024)))
+        return mp;
+    if((mp = mp_search(MP_BASE_MEM_END, 1024)))
+        return mp;
+    return mp_search(MP_BIOS_ROM_START, MP_BIOS_ROM_END - MP_BIOS_ROM_START);
+}
+
+/*
+ * Size of a configuration table entry, processors take 20 bytes, everything else 8
+ * */
+static uint32_t mp_entry_size(uint8_t * entry) {
+    return *entry == MP_PROCESSOR ? sizeof(mp_processor_t) : 8;
+}
+
+/*
+ * Route the vectored interrupts of the table through the io apic, to the vectors the pics used(32 + irq), all to the bsp
+ * An isa irq keeps its number, whichever pin it's wired to(the pit usually sits on pin 2), a pci interrupt uses its pin, which is the irq its pci config says
+ * */
+static void mp_route_irqs(mp_config_t * config, uint8_t * isa_bus) {
+    uint8_t * entry = (uint8_t*)(config + 1);
+    for(uint32_t i = 0; i < config->entry_count; entry += mp_entry_size(entry), i++) {
+        if(*entry != MP_IOINTR) continue;
+        mp_iointr_t * intr = (mp_iointr_t*)entry;
+        if(intr->intr_type != MP_INTR_INT) continue;
+        int isa = isa_bus[intr->src_bus];
+        uint32_t irq = isa ? intr->src_irq : intr->dst_pin;
+        if(irq >= 16) {
+            qemu_printf("smp: irq %u(pin %u) isn't routed, there's no vector for it\n", irq, intr->dst_pin);
+            continue;
+        }
+        // Isa interrupts are edge triggered and active high unless the table says otherwise, pci ones level triggered and active low
+        uint32_t polarity = intr->flags & MP_POLARITY_MASK;
+        uint32_t trigger = intr->flags & MP_TRIGGER_MASK;
+        uint32_t flags = 0;
+        if(polarity == MP_POLARITY_LOW || (!polarity && !isa))
+            flags |= IOAPIC_ACTIVE_LOW;
+        if(trigger == MP_TRIGGER_LEVEL || (!trigger && !isa))
+            flags |= IOAPIC_LEVEL;
+        ioapic_route(intr->dst_pin, 32 + irq, flags, cpus[0].apic_id);
+    }
+}
+
+/*
+ * Somebody else's run queue got a task that should run before what we're running(see sched_wakeup), the irq return does the rest
+ * */
+static void smp_resched_handler(register_t * reg) {
+    sched_preempt(reg);
+}
+
+/*
+ * An application processor comes here from the trampoline, on its own stack with the bsp's page directory
+ * */
+static void ap_start() {
+    // The trampoline's temporary gdt is gone with its page, load the real ones
+    gdt_flush((uint32_t)&gdt_ptr);
+    idt_flush((uint32_t)&idt_ptr);
+    // From here on this_cpu() knows which cpu we are
+    uint32_t id = smp_booting;
+    tss_init(id, 0x10, 0);
+    lock_kernel();
+    cpu_t * c = this_cpu();
+    lapic_init_ap();
+    fpu_init_ap();
+    sched_start_cpu(c);
+    c->online = 1;
+    qemu_printf("smp: cpu %u(apic id %u) is up\n", id, c->apic_id);
+    // Off to the first task(the idle task if there's nothing to take from the other cpus), we never come back here
+    asm volatile("cli");
+    schedule();
+}
+
+/*
+ * Start the application processor cpus[id], returns whether it came up
+ * */
+static int smp_boot_ap(uint32_t id) {
+    cpu_t * c = &cpus[id];
+    uint32_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    // The ap starts with the bsp's paging setup(but not with TS set, it has its own fpu)
+    trampoline_cr0 = cr0 & ~CR0_TS;
+    trampoline_cr3 = (uint32_t)kpage_dir;
+    trampoline_cr4 = cr4;
+    trampoline_esp = (uint32_t)kmalloc(KSTACK_SIZE) + KSTACK_SIZE;
+    trampoline_entry = (uint32_t)ap_start;
+    memcpy((void*)(LOAD_MEMORY_ADDRESS + TRAMPOLINE_BASE), smp_trampoline, smp_trampoline_end - smp_trampoline);
+    smp_booting = id;
+
+    lapic_send_init(c->apic_id);
+    apic_udelay(SMP_INIT_DELAY_US);
+    // The second startup ipi is only for cpus that missed the first one
+    for(int i = 0; i < 2 && !c->online; i++) {
+        lapic_send_startup(c->apic_id, TRAMPOLINE_BASE >> 12);
+        apic_udelay(SMP_STARTUP_DELAY_US);
+    }
+    for(uint32_t waited = 0; !c->online && waited < SMP_ONLINE_TIMEOUT_US; waited += SMP_STARTUP_DELAY_US)
+        apic_udelay(SMP_STARTUP_DELAY_US);
+    return c->online;
+}
+
+/*
+ * Switch to the apics and bring up every cpu of the mp table, the system stays on one cpu with the pics if there's no table
+ * Call it after process_init(), before any task runs
+ * */
+void smp_init() {
+    mp_floating_t * mp = mp_find();
+    if(!mp || !mp->config || mp->config >= 4 * M) {
+        qemu_printf("smp: no mp configuration table, running on one cpu\n");
+        return;
+    }
+    mp_config_t * config = (mp_config_t*)(LOAD_MEMORY_ADDRESS + mp->config);
+    if(memcmp((uint8_t*)config->signature, (uint8_t*)"PCMP", 4) || mp_checksum(config, config->length)) {
+        qemu_printf("smp: bad mp configuration table, running on one cpu\n");
+        return;
+    }
+
+    // Find the io apic, the application processors and which buses are isa
+    uint8_t isa_bus[256];
+    memset(isa_bus, 0, sizeof(isa_bus));
+    uint32_t ioapic_addr = IOAPIC_DEFAULT_BASE;
+    uint8_t * entry = (uint8_t*)(config + 1);
+    for(uint32_t i = 0; i < config->entry_count; entry += mp_entry_size(entry), i++) {
+        if(*entry == MP_PROCESSOR) {
+            mp_processor_t * cpu = (mp_processor_t*)entry;
+            if(!(cpu->flags & MP_CPU_ENABLED) || (cpu->flags & MP_CPU_BSP))
+                continue;
+            if(num_cpus == MAX_CPUS) {
+                qemu_printf("smp: more than %u cpus, apic id %u is left alone\n", MAX_CPUS, cpu->apic_id);
+                continue;
+            }
+            cpus[num_cpus].id = num_cpus;
+            cpus[num_cpus].apic_id = cpu->apic_id;
+            num_cpus++;
+        }
+        else if(*entry == MP_BUS) {
+            mp_bus_t * bus = (mp_bus_t*)entry;
+            isa_bus[bus->bus_id] = !memcmp((uint8_t*)bus->bus_type, (uint8_t*)"ISA", 3);
+        }
+        else if(*entry == MP_IOAPIC) {
+            ioapic_addr = ((mp_ioapic_t*)entry)->addr;
+        }
+    }
+
+    // Move the irqs from the pics to the io apic, nothing may come in halfway
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    lapic_init(config->lapic_addr ? config->lapic_addr : LAPIC_DEFAULT_BASE);
+    cpus[0].apic_id = lapic_id();
+    ioapic_init(ioapic_addr);
+    mp_route_irqs(config, isa_bus);
+    if(mp->features & MP_IMCR_PRESENT) {
+        // Connect the bsp to its local apic instead of the pics
+        outportb(0x22, 0x70);
+        outportb(0x23, 0x01);
+    }
+    pic_disable();
+    apic_enabled = 1;
+    // Every cpu's local apic timer is its scheduler tick from now on
+    register_interrupt_handler(LAPIC_TIMER_VECTOR, sched_lapic_tick);
+    register_interrupt_handler(RESCHED_VECTOR, smp_resched_handler);
+    timer_cancel(&sched_timer);
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+    lapic_timer_init();
+
+    uint32_t online = 1;
+    for(uint32_t i = 1; i < num_cpus; i++) {
+        if(smp_boot_ap(i))
+            online++;
+        else
+            qemu_printf("smp: cpu %u(apic id %u) didn't start\n", i, cpus[i].apic_id);
+    }
+    qemu_printf("smp: %u of %u cpus online\n", online, num_cpus);
+}
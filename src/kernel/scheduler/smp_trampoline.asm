@@ -0,0 +1,64 @@
+; Application processor startup code, smp_init() copies it to TRAMPOLINE_BASE and points the startup ipi there
+; The ap starts in real mode, it loads a flat gdt of its own, enters protected mode, then turns paging on with the bsp's cr0/cr3/cr4,
+; takes its kernel stack and jumps to ap_start(), smp_init() fills in the values at the end before copying
+
+[bits 16]
+
+global smp_trampoline
+global smp_trampoline_end
+global trampoline_cr0
+global trampoline_cr3
+global trampoline_cr4
+global trampoline_esp
+global trampoline_entry
+
+%define TRAMPOLINE_BASE                        0x7000
+%define T(x)                                   (((x) - smp_trampoline) + TRAMPOLINE_BASE)
+%define CODE32                                 0x08
+%define DATA32                                 0x10
+
+section .text
+smp_trampoline:
+    cli
+    xor ax, ax
+    mov ds, ax
+    lgdt [T(trampoline_gdt_ptr)]
+    mov eax, cr0
+    or eax, 0x1
+    mov cr0, eax
+    jmp dword CODE32:T(trampoline_pm)
+
+[bits 32]
+trampoline_pm:
+    mov ax, DATA32
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    ; Low memory is identity mapped in the kernel page directory, so we keep running here once paging is on
+    mov eax, [T(trampoline_cr4)]
+    mov cr4, eax
+    mov eax, [T(trampoline_cr3)]
+    mov cr3, eax
+    mov eax, [T(trampoline_cr0)]
+    mov cr0, eax
+    mov esp, [T(trampoline_esp)]
+    mov eax, [T(trampoline_entry)]
+    jmp eax
+
+align 8
+trampoline_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF                      ; kernel code, same as gdt_init()'s
+    dq 0x00CF92000000FFFF                      ; kernel data
+trampoline_gdt_ptr:
+    dw trampoline_gdt_ptr - trampoline_gdt - 1
+    dd T(trampoline_gdt)
+
+trampoline_cr0:   dd 0
+trampoline_cr3:   dd 0
+trampoline_cr4:   dd 0
+trampoline_esp:   dd 0
+trampoline_entry: dd 0
+smp_trampoline_end:
@@ -0,0 +1,257 @@
+#include <spinlock.h>
+#include <timer.h>
+#include <serial.h>
+
+/*
+ * Spinlocks
+ * spinlock_t is a ticket lock: lock takes a ticket with one lock xadd and spins until owner reaches it, unlock moves owner on, so waiters get the lock in the order they came
+ * rwlock_t lets readers in together, a writer sets RW_WRITER first(new readers wait from then on) and then waits for the readers inside to leave
+ * The _irqsave variants turn interrupts off before spinning and give back the old eflags, use them for locks an irq handler also takes
+ * With LOCK_STATS every lock counts its acquisitions, how often and how long lockers waited, and how long it was held(writers only for a rwlock)
+ * */
+
+static inline uint32_t atomic_xadd(volatile uint32_t * p, uint32_t v) {
+    asm volatile("lock xaddl %0, %1" : "+r"(v), "+m"(*p) : : "memory");
+    return v;
+}
+
+static inline uint32_t atomic_cmpxchg(volatile uint32_t * p, uint32_t old, uint32_t new) {
+    uint32_t prev;
+    asm volatile("lock cmpxchgl %2, %1" : "=a"(prev), "+m"(*p) : "r"(new), "0"(old) : "memory");
+    return prev;
+}
+
+#if LOCK_STATS
+// Every lock that has been taken at least once, for lock_print_stats()
+lock_stats_t * lock_stats_list;
+ktimer_t lock_stats_timer;
+
+/*
+ * Lock free, because user mode code(the ring 3 demo takes print_lock) can't cli
+ * Whoever flips registered from 0 to 1 pushes the lock onto the list, nothing is ever taken off it
+ * */
+static void lock_stats_register(lock_stats_t * s) {
+    if(atomic_cmpxchg((volatile uint32_t*)&s->registered, 0, 1) != 0)
+        return;
+    uint32_t head;
+    do {
+        head = (uint32_t)lock_stats_list;
+        s->next = (lock_stats_t*)head;
+    } while(atomic_cmpxchg((volatile uint32_t*)&lock_stats_list, head, (uint32_t)s) != head);
+}
+
+/*
+ * Called with the lock just taken, start is when the locker started waiting(0 if it didn't have to)
+ * */
+static void lock_stats_acquired(lock_stats_t * s, uint64_t start) {
+    uint64_t now = rdtsc();
+    if(!s->registered)
+        lock_stats_register(s);
+    s->acquisitions++;
+    if(start) {
+        s->contended++;
+        s->wait_cycles += now - start;
+    }
+    s->acquired_at = now;
+}
+
+static void lock_stats_released(lock_stats_t * s) {
+    uint32_t held = rdtsc() - s->acquired_at;
+    s->hold_cycles += held;
+    if(held > s->max_hold)
+        s->max_hold = held;
+    uint32_t bucket = held ? 31 - __builtin_clz(held) : 0;
+    bucket = bucket < LOCK_HIST_SHIFT ? 0 : bucket - LOCK_HIST_SHIFT;
+    if(bucket >= LOCK_HIST_BUCKETS)
+        bucket = LOCK_HIST_BUCKETS - 1;
+    s->hold_hist[bucket]++;
+}
+#define STATS_ACQUIRED(lock, start) lock_stats_acquired(&(lock)->stats, start)
+#define STATS_RELEASED(lock) lock_stats_released(&(lock)->stats)
+#define STATS_WAIT_START(start) start = rdtsc()
+#else
+#define STATS_ACQUIRED(lock, start) (void)(start)
+#define STATS_RELEASED(lock)
+#define STATS_WAIT_START(start) start = 1
+#endif
+
+static inline uint32_t irq_save() {
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    return eflags;
+}
+
+static inline void irq_restore(uint32_t eflags) {
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+void spinlock_init(spinlock_t * lock, const char * name) {
+    memset(lock, 0, sizeof(spinlock_t));
+#if LOCK_STATS
+    lock->stats.name = name;
+#endif
+}
+
+void spinlock_lock(spinlock_t * lock) {
+    uint64_t start = 0;
+    // Take a ticket, next is the upper half of value
+    uint16_t ticket = atomic_xadd(&lock->value, 1 << 16) >> 16;
+    if(lock->owner != ticket) {
+        STATS_WAIT_START(start);
+        while(lock->owner != ticket)
+            asm volatile("pause" : : : "memory");
+    }
+    STATS_ACQUIRED(lock, start);
+}
+
+/*
+ * Take the lock only if nobody holds it or waits for it, returns 1 if it was taken
+ * */
+int spinlock_trylock(spinlock_t * lock) {
+    uint32_t old = lock->value;
+    if((old >> 16) != (old & 0xFFFF))
+        return 0;
+    if(atomic_cmpxchg(&lock->value, old, old + (1 << 16)) != old)
+        return 0;
+    STATS_ACQUIRED(lock, 0);
+    return 1;
+}
+
+void spinlock_unlock(spinlock_t * lock) {
+    STATS_RELEASED(lock);
+    // Only the holder writes owner, a plain store is enough, the barrier keeps the critical section before it
+    asm volatile("" : : : "memory");
+    lock->owner++;
+}
+
+uint32_t spinlock_lock_irqsave(spinlock_t * lock) {
+    uint32_t eflags = irq_save();
+    spinlock_lock(lock);
+    return eflags;
+}
+
+void spinlock_unlock_irqrestore(spinlock_t * lock, uint32_t eflags) {
+    spinlock_unlock(lock);
+    irq_restore(eflags);
+}
+
+void rwlock_init(rwlock_t * lock, const char * name) {
+    memset(lock, 0, sizeof(rwlock_t));
+#if LOCK_STATS
+    lock->stats.name = name;
+#endif
+}
+
+void read_lock(rwlock_t * lock) {
+    uint64_t start = 0;
+    for(;;) {
+        uint32_t v = lock->value;
+        if(!(v & RW_WRITER) && atomic_cmpxchg(&lock->value, v, v + 1) == v)
+            break;
+        if(!start)
+            STATS_WAIT_START(start);
+        asm volatile("pause" : : : "memory");
+    }
+#if LOCK_STATS
+    // Readers overlap, so only the acquisitions and waits are counted, not the hold time
+    lock_stats_t * s = &lock->stats;
+    if(!s->registered)
+        lock_stats_register(s);
+    atomic_xadd(&s->acquisitions, 1);
+    if(start) {
+        atomic_xadd(&s->contended, 1);
+        s->wait_cycles += rdtsc() - start;
+    }
+#endif
+}
+
+void read_unlock(rwlock_t * lock) {
+    atomic_xadd(&lock->value, -1);
+}
+
+void write_lock(rwlock_t * lock) {
+    uint64_t start = 0;
+    // Claim the writer bit first, then wait for the readers already inside
+    for(;;) {
+        uint32_t v = lock->value;
+        if(!(v & RW_WRITER) && atomic_cmpxchg(&lock->value, v, v | RW_WRITER) == v)
+            break;
+        if(!start)
+            STATS_WAIT_START(start);
+        asm volatile("pause" : : : "memory");
+    }
+    while(lock->value != RW_WRITER) {
+        if(!start)
+            STATS_WAIT_START(start);
+        asm volatile("pause" : : : "memory");
+    }
+    STATS_ACQUIRED(lock, start);
+}
+
+void write_unlock(rwlock_t * lock) {
+    STATS_RELEASED(lock);
+    asm volatile("" : : : "memory");
+    lock->value = 0;
+}
+
+uint32_t read_lock_irqsave(rwlock_t * lock) {
+    uint32_t eflags = irq_save();
+    read_lock(lock);
+    return eflags;
+}
+
+void read_unlock_irqrestore(rwlock_t * lock, uint32_t eflags) {
+    read_unlock(lock);
+    irq_restore(eflags);
+}
+
+uint32_t write_lock_irqsave(rwlock_t * lock) {
+    uint32_t eflags = irq_save();
+    write_lock(lock);
+    return eflags;
+}
+
+void write_unlock_irqrestore(rwlock_t * lock, uint32_t eflags) {
+    write_unlock(lock);
+    irq_restore(eflags);
+}
+
+/*
+ * Dump the statistics of every lock taken so far to the serial port
+ * */
+void lock_print_stats() {
+#if LOCK_STATS
+    qemu_printf("locks(name: acquisitions, contended, avg wait, avg hold, max hold, in tsc cycles):\n");
+    for(lock_stats_t * s = lock_stats_list; s; s = s->next) {
+        uint32_t avg_wait = s->contended ? (uint32_t)(s->wait_cycles / s->contended) : 0;
+        uint32_t avg_hold = s->acquisitions ? (uint32_t)(s->hold_cycles / s->acquisitions) : 0;
+        qemu_printf("  %s: %u, %u, %u, %u, %u\n", s->name ? s->name : "(unnamed)", s->acquisitions, s->contended, avg_wait, avg_hold, s->max_hold);
+        for(uint32_t i = 0; i < LOCK_HIST_BUCKETS; i++) {
+            if(s->hold_hist[i])
+                qemu_printf("    held %u - %u cycles: %u\n", i ? 1 << (i + LOCK_HIST_SHIFT) : 0, (2 << (i + LOCK_HIST_SHIFT)) - 1, s->hold_hist[i]);
+        }
+    }
+#else
+    qemu_printf("locks: no statistics, build with LOCK_STATS\n");
+#endif
+}
+
+#if LOCK_STATS
+static void lock_stats_tick(void * data) {
+    lock_print_stats();
+}
+#endif
+
+/*
+ * Print the lock statistics every sec seconds, 0 stops it
+ * */
+void lock_stats_periodic(uint32_t sec) {
+#if LOCK_STATS
+    if(!sec) {
+        timer_cancel(&lock_stats_timer);
+        return;
+    }
+    timer_setup(&lock_stats_timer, lock_stats_tick, NULL);
+    timer_start(&lock_stats_timer, TIMER_SEC(sec), TIMER_SEC(sec));
+#endif
+}
@@ -0,0 +1,95 @@
+#include <wait_queue.h>
+#include <process.h>
+#include <smp.h>
+
+/*
+ * Wait queues
+ * Every task has a kernel stack of its own, so a task sleeping inside the kernel really gives up the cpu, schedule() switches away from its stack and back once it's woken up
+ * Before the first task runs there's nothing to switch to, the cpu halts until an interrupt instead and the caller checks its condition again
+ * */
+
+static void sleep_timeout(void * data) {
+    sched_wakeup(data);
+}
+
+/*
+ * Block the current task(interrupts off) on wq, or only until sched_wakeup() if wq is NULL, and run something else until it's woken up or delay pit ticks passed
+ * Returns 0 if it timed out
+ * */
+static uint32_t sleep_until(wait_queue_t * wq, uint64_t delay, int timeout) {
+    pcb_t * p = current_process;
+    if(!p) {
+        // No task yet(we're still initializing), nothing can be blocked, just wait for the next interrupt
+        uint64_t deadline = timer_now() + delay;
+        asm volatile("sti; hlt; cli");
+        return !timeout || timer_now() < deadline;
+    }
+    lock_kernel();
+    if(timeout) {
+        timer_setup(&p->sleep_timer, sleep_timeout, p);
+        timer_start(&p->sleep_timer, delay, 0);
+    }
+    if(wq)
+        list_insert_back(&wq->waiters, p);
+    sched_block(p);
+    while(p->state == TASK_INTERRUPTIBLE)
+        schedule();
+    if(!timeout) {
+        unlock_kernel();
+        return 1;
+    }
+    if(timer_pending(&p->sleep_timer)) {
+        // wake_up() got here first
+        timer_cancel(&p->sleep_timer);
+        unlock_kernel();
+        return 1;
+    }
+    // The timer woke us up, we're still on the queue
+    if(wq) {
+        foreach(t, (&wq->waiters)) {
+            if(t->val == p) {
+                list_remove_node(&wq->waiters, t);
+                break;
+            }
+        }
+    }
+    unlock_kernel();
+    return 0;
+}
+
+/*
+ * Sleep on wq until wake_up(wq), call it with interrupts off after checking the condition being waited for(see wait_event)
+ * */
+void sleep_on(wait_queue_t * wq) {
+    sleep_until(wq, 0, 0);
+}
+
+/*
+ * Same as sleep_on, but give up after ticks timer ticks, returns 0 if it timed out
+ * */
+uint32_t sleep_on_timeout(wait_queue_t * wq, uint32_t ticks) {
+    return sleep_until(wq, (uint64_t)ticks * TIMER_JIFFY, 1);
+}
+
+/*
+ * Block the current task for delay pit ticks(see TIMER_US)
+ * */
+void sleep_for(uint64_t delay) {
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    uint64_t deadline = timer_now() + delay;
+    for(uint64_t now = timer_now(); now < deadline && sleep_until(NULL, deadline - now, 1); now = timer_now());
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+/*
+ * Wake every task sleeping on wq, safe to call from an irq handler
+ * */
+void wake_up(wait_queue_t * wq) {
+    lock_kernel();
+    while(list_size(&wq->waiters)) {
+        pcb_t * p = list_remove_front(&wq->waiters);
+        sched_wakeup(p);
+    }
+    unlock_kernel();
+}
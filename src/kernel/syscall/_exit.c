@@ -4,10 +4,22 @@
  * Syscall , exit current process
  * */
 void _exit() {
+    pcb_t * p = current_process;
     // First set the state of current process to zombie
-    current_process->state = TASK_ZOMBIE;
-    // maybe reclaim all the physical memory in-use by this process too(like call the paging system to reclaim all user page of current page directories), but we'll worry about this
-    // laster, let's just waste those physical memory for now(and other possible resources possess by the process).
+    p->state = TASK_ZOMBIE;
+
+    // Give back everything the process owns, from the kernel's address space since the process's own is about to go away
+    switch_page_directory(kpage_dir);
+    for(int i = 0; i < PROCESS_MAX_FILES; i++) {
+        if(p->files[i])
+            vfs_close(p->files[i]);
+        p->files[i] = NULL;
+    }
+    vma_destroy_list(p->vmas);
+    p->vmas = NULL;
+    free_page_directory(p->page_dir);
+    p->page_dir = NULL;
+    p->cr3 = 0;
 
     // Then do schedule() so that scheduler transfer control to next process (when scheduler notice that it's a zombie process)
     // the timer handler will push a pointer to current process context to the schedule function
@@ -0,0 +1,29 @@
+#include <syscall.h>
+
+/*
+ * Syscall open, returns a file descriptor, or -1 if the file doesn't exist or the process has too many open files
+ * */
+int open(char * path, uint32_t flags) {
+    pcb_t * p = current_process;
+    for(int fd = 0; fd < PROCESS_MAX_FILES; fd++) {
+        if(p->files[fd]) continue;
+        vfs_node_t * file = file_open(path, flags);
+        if(!file)
+            return -1;
+        p->files[fd] = file;
+        return fd;
+    }
+    return -1;
+}
+
+/*
+ * Syscall close, mappings of the file stay valid
+ * */
+int close(int fd) {
+    pcb_t * p = current_process;
+    if(fd < 0 || fd >= PROCESS_MAX_FILES || !p->files[fd])
+        return -1;
+    vfs_close(p->files[fd]);
+    p->files[fd] = NULL;
+    return 0;
+}
@@ -1,8 +1,58 @@
 #include <syscall.h>
+#include <slab.h>
+#include <fpu.h>
+
+// Defined in process.c
+extern kmem_cache_t * pcb_cache;
 
 /*
  * Syscall fork
+ * The child gets a copy-on-write copy of the caller's address space, so forking only costs the page tables
+ * It starts running right after the int 0x80 that called fork, fork returns 0 in the child and the child's pid in the parent
  * */
 pid_t fork() {
+    pcb_t * parent = current_process;
+    pcb_t * child = kmem_cache_zalloc(pcb_cache);
+    child->pid = allocate_pid();
+    strcpy(child->filename, parent->filename);
+    child->stack = parent->stack;
+    child->time_slice = parent->time_slice;
+    child->priority = parent->priority;
+
+    child->page_dir = alloc_page_directory();
+    if(!child->page_dir) {
+        kmem_cache_free(pcb_cache, child);
+        return -1;
+    }
+    if(!copy_page_directory(child->page_dir, parent->page_dir)) {
+        // Out of memory, drop the references to the frames shared so far
+        free_page_directory(child->page_dir);
+        kmem_cache_free(pcb_cache, child);
+        return -1;
+    }
+    // Every user page of the parent is shared with(or copied for) the child
+    child->resident_pages = parent->resident_pages;
+    // Pages the parent never touched are still loaded on demand in the child
+    child->vmas = vma_copy_list(parent->vmas);
+    child->brk_start = parent->brk_start;
+    child->brk = parent->brk;
+    // Open files are shared with the child
+    for(int i = 0; i < PROCESS_MAX_FILES; i++) {
+        child->files[i] = parent->files[i];
+        if(child->files[i] && child->files[i]->refcount >= 0)
+            child->files[i]->refcount++;
+    }
 
+    // The parent's user mode registers were pushed at the top of its kernel stack when it trapped into the kernel, the child leaves the kernel with a copy of them
+    child->kstack = kmalloc(KSTACK_SIZE);
+    register_t * frame = task_frame(child);
+    memcpy(frame, task_frame(parent), sizeof(register_t));
+    frame->eax = 0;
+    child->kesp = task_stack_init((uint32_t*)frame, task_entry_user);
+    child->cr3 = (uint32_t)child->page_dir;
+    fpu_fork(parent, child);
+    child->state = TASK_CREATED;
+    child->self = list_insert_front(process_list, child);
+    sched_enqueue(child);
+    return child->pid;
 }
@@ -0,0 +1,105 @@
+#include <syscall.h>
+#include <vma.h>
+
+/*
+ * Memory management syscalls, brk/sbrk for the heap, and anonymous mmap/munmap
+ * None of them map anything, they only add or remove areas of the process's address space, pages are mapped when they're first touched(see handle_demand_fault)
+ * */
+
+/*
+ * Set the end of the heap to addr, returns the new end, or the current one if it can't be moved there(brk(0) just asks for it)
+ * */
+uint32_t brk(uint32_t addr) {
+    pcb_t * p = current_process;
+    if(addr < p->brk_start || addr >= USER_MMAP_BOTTOM)
+        return p->brk;
+    uint32_t old_end = ALIGN(p->brk, PAGE_SIZE), new_end = ALIGN(addr, PAGE_SIZE);
+    vm_area_t * heap = vma_find_flags(p->vmas, VMA_HEAP);
+    if(new_end > old_end) {
+        if(vma_overlaps(p->vmas, old_end, new_end))
+            return p->brk;
+        if(heap)
+            heap->end = new_end;
+        else
+            vma_add(&p->vmas, p->brk_start, new_end, VMA_READ | VMA_WRITE | VMA_HEAP, NULL, 0, 0);
+    }
+    else if(new_end < old_end) {
+        free_mapped_region(p->page_dir, new_end, old_end);
+        vma_remove(&p->vmas, new_end, old_end);
+    }
+    p->brk = addr;
+    return p->brk;
+}
+
+/*
+ * Move the end of the heap by increment bytes, returns the old end, or (void*)-1 if it can't be moved
+ * */
+void * sbrk(int increment) {
+    uint32_t old = current_process->brk;
+    if(brk(old + increment) != old + increment)
+        return (void*)-1;
+    return (void*)old;
+}
+
+/*
+ * Map length bytes of zero filled memory, returns where, or MAP_FAILED
+ * addr is only a hint, unless MAP_FIXED is set(the range is then unmapped first)
+ * */
+void * mmap(void * addr, uint32_t length, uint32_t prot, uint32_t flags) {
+    pcb_t * p = current_process;
+    uint32_t start = (uint32_t)addr & 0xfffff000;
+    length = ALIGN(length, PAGE_SIZE);
+    if(!length || !(flags & MAP_ANONYMOUS))
+        return MAP_FAILED;
+    if(flags & MAP_FIXED) {
+        if(start + length < start || start + length > LOAD_MEMORY_ADDRESS)
+            return MAP_FAILED;
+        munmap((void*)start, length);
+    }
+    else if(!start || start + length < start || start + length > USER_MMAP_TOP || vma_overlaps(p->vmas, start, start + length)) {
+        start = vma_find_gap(p->vmas, length, USER_MMAP_BOTTOM, USER_MMAP_TOP);
+        if(!start)
+            return MAP_FAILED;
+    }
+    uint32_t vma_flags = 0;
+    if(prot & PROT_READ) vma_flags |= VMA_READ;
+    if(prot & PROT_WRITE) vma_flags |= VMA_WRITE;
+    if(prot & PROT_EXEC) vma_flags |= VMA_EXEC;
+    vma_add(&p->vmas, start, start + length, vma_flags, NULL, 0, 0);
+    return (void*)start;
+}
+
+/*
+ * Map length bytes of an open file from offset(must be page aligned), returns where, or MAP_FAILED
+ * Pages are the file's page cache pages, nothing is copied unless the process writes to a page(only if prot allows it, the copy is private)
+ * */
+void * mmap_file(int fd, uint32_t offset, uint32_t length, uint32_t prot) {
+    pcb_t * p = current_process;
+    if(fd < 0 || fd >= PROCESS_MAX_FILES || !p->files[fd] || (offset & 0xfff) || !length)
+        return MAP_FAILED;
+    vfs_node_t * file = p->files[fd];
+    length = ALIGN(length, PAGE_SIZE);
+    uint32_t start = vma_find_gap(p->vmas, length, USER_MMAP_BOTTOM, USER_MMAP_TOP);
+    if(!start)
+        return MAP_FAILED;
+    uint32_t vma_flags = VMA_PAGECACHE;
+    if(prot & PROT_READ) vma_flags |= VMA_READ;
+    if(prot & PROT_WRITE) vma_flags |= VMA_WRITE;
+    if(prot & PROT_EXEC) vma_flags |= VMA_EXEC;
+    vma_add(&p->vmas, start, start + length, vma_flags, file, offset, length);
+    return (void*)start;
+}
+
+/*
+ * Unmap [addr, addr + length), frames that were touched go back to the pmm
+ * */
+int munmap(void * addr, uint32_t length) {
+    uint32_t start = (uint32_t)addr;
+    if(start & 0xfff || !length || start + length < start || start + length > LOAD_MEMORY_ADDRESS)
+        return -1;
+    // A partial page at the end goes too, like the rest of the page it's in
+    length = ALIGN(length, PAGE_SIZE);
+    free_mapped_region(current_process->page_dir, start, start + length);
+    vma_remove(&current_process->vmas, start, start + length);
+    return 0;
+}
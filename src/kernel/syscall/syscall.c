@@ -5,14 +5,22 @@ void * syscall_table[NUM_SYSCALLS] = {
     schedule,
     qemu_printf,
     create_process_from_routine,
-    _exit
+    _exit,
+    fork,
+    brk,
+    sbrk,
+    mmap,
+    munmap,
+    open,
+    close,
+    mmap_file,
+    nanosleep
 };
 
 void syscall_dispatcher(register_t * regs) {
     if(regs->eax >= NUM_SYSCALLS) return;
     void * system_api = syscall_table[regs->eax];
     int ret;
-    memcpy(&saved_context, regs, sizeof(register_t));
     asm volatile (" \
      push %1; \
      push %2; \
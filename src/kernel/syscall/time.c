@@ -0,0 +1,23 @@
+#include <syscall.h>
+#include <wait_queue.h>
+
+/*
+ * Syscall nanosleep
+ * The caller is blocked(it doesn't use any cpu) for at least the requested time, the timer has a resolution of one pit input clock tick(~838ns)
+ * Nothing can interrupt the sleep, so rem is always zero
+ * */
+int nanosleep(const timespec_t * req, timespec_t * rem) {
+    if(!req || req->tv_nsec >= 1000000000)
+        return -1;
+    // Rounded up, so we never sleep for less than asked
+    uint64_t delay = TIMER_SEC(req->tv_sec) + TIMER_US((req->tv_nsec + 999) / 1000) + 1;
+    if(rem) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    if(!req->tv_sec && !req->tv_nsec)
+        return 0;
+
+    sleep_for(delay);
+    return 0;
+}